@@ -0,0 +1,242 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Bootstrap confidence intervals of the EVT fit.  Block maxima are
+ * resampled straight from their histogram (t->maxes) by drawing new counts
+ * from the multinomial distribution, each replicate is refitted with the
+ * same kernels as the main fit starting from the point estimate.  Refits
+ * run as pool tasks.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define BOOT_CI		0.95
+#define BOOT_SEED	0x6d67725f626f6f74ULL
+
+struct boot_rng {
+	u64 s[4];
+};
+
+static inline u64 rotl(const u64 x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline u64 splitmix64(u64 *x)
+{
+	u64 z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void rng_seed(struct boot_rng *rng, u64 seed)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		rng->s[i] = splitmix64(&seed);
+}
+
+/* xoshiro256** */
+static inline u64 rng_next(struct boot_rng *rng)
+{
+	u64 *s = rng->s;
+	const u64 res = rotl(s[1] * 5, 7) * 9;
+	const u64 t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return res;
+}
+
+/* uniform in (0, 1) */
+static inline double rng_unif(struct boot_rng *rng)
+{
+	return ((rng_next(rng) >> 11) + 0.5) * (1.0 / (1ULL << 53));
+}
+
+static inline double rng_norm(struct boot_rng *rng)
+{
+	return sqrt(-2 * log(rng_unif(rng))) * cos(2 * M_PI * rng_unif(rng));
+}
+
+static u32 rng_binomial(struct boot_rng *rng, u32 n, double p)
+{
+	double mean, x;
+	u32 k = 0;
+
+	if (p <= 0 || !n)
+		return 0;
+	if (p >= 1)
+		return n;
+
+	mean = n * p;
+	if (mean > 15 && n - mean > 15) {
+		x = round(mean + sqrt(mean * (1 - p)) * rng_norm(rng));
+		return x < 0 ? 0 : x > n ? n : x;
+	}
+
+	if (p > 0.5)
+		return n - rng_binomial(rng, n, 1 - p);
+
+	/* count geometric waiting times until we run past n trials */
+	x = log1p(-p);
+	while (true) {
+		double skip = floor(log(rng_unif(rng)) / x);
+
+		if (skip >= n)
+			return k;
+		n -= skip + 1;
+		k++;
+	}
+}
+
+/* Multinomial draw of @n_maxes block maxima from the histogram @src,
+ * entries which were not drawn are squashed out.  Returns # of entries.
+ */
+static u32 boot_resample(struct boot_rng *rng, const struct distribution *src,
+			 u32 n, u32 n_maxes, struct distribution *dst)
+{
+	u32 i, j, cnt, left = n_maxes, left_src = n_maxes;
+
+	for (i = j = 0; i < n && left; i++) {
+		cnt = rng_binomial(rng, left, (double)src[i].cnt / left_src);
+		left_src -= src[i].cnt;
+		left -= cnt;
+
+		if (cnt) {
+			dst[j].val = src[i].val;
+			dst[j].cnt = cnt;
+			j++;
+		}
+	}
+
+	return j;
+}
+
+/* Replicates are split into a fixed number of chunks, each with its own
+ * RNG stream, so that results don't depend on the number of workers.
+ */
+#define BOOT_CHUNKS	64
+
+struct boot_work {
+	struct trace *t;
+	u32 id;
+	u32 n_chunks;
+
+	double *res[4]; /* m, s, a, xceed per replicate */
+};
+
+static void boot_worker(void *arg)
+{
+	struct boot_work *w = arg;
+	const struct trace *t = w->t;
+	const u32 n = tal_count(t->maxes);
+	struct distribution *rdistr;
+	struct evt_distr ed;
+	struct boot_rng rng;
+	u32 i, r, n_maxes = 0, rn;
+
+	for (i = 0; i < n; i++)
+		n_maxes += t->maxes[i].cnt;
+
+	rng_seed(&rng, BOOT_SEED ^ ((u64)w->id << 32));
+	rdistr = malloc(n * sizeof(*rdistr));
+
+	for (r = w->id; r < args.boot_reps; r += w->n_chunks) {
+		rn = boot_resample(&rng, t->maxes, n, n_maxes, rdistr);
+
+		ed = t->ed;
+		fit_evt(&ed, rdistr, rn);
+
+		w->res[0][r] = ed.m;
+		w->res[1][r] = ed.s;
+		w->res[2][r] = ed.a;
+		w->res[3][r] = evt_xceed(&ed, 0.0001);
+	}
+
+	free(rdistr);
+}
+
+static int cmp_double(const void *a1, const void *a2)
+{
+	const double *d1 = a1, *d2 = a2;
+
+	return (*d1 > *d2) - (*d1 < *d2);
+}
+
+static void boot_ci(double *res, u32 n, double ci[2])
+{
+	qsort(res, n, sizeof(*res), cmp_double);
+
+	ci[0] = res[(u32)floor((1 - BOOT_CI) / 2 * (n - 1))];
+	ci[1] = res[(u32)ceil((1 + BOOT_CI) / 2 * (n - 1))];
+}
+
+void calc_bootstrap(struct trace *t)
+{
+	const u32 n_chunks = args.boot_reps < BOOT_CHUNKS ?
+		args.boot_reps : BOOT_CHUNKS;
+	struct task_group grp = {};
+	struct boot_work *work;
+	double *res;
+	u32 i, j;
+
+	if (!t->maxes || !args.boot_reps)
+		return;
+
+	res = malloc(4 * args.boot_reps * sizeof(*res));
+	work = malloc(n_chunks * sizeof(*work));
+
+	for (i = 0; i < n_chunks; i++) {
+		work[i].t = t;
+		work[i].id = i;
+		work[i].n_chunks = n_chunks;
+		for (j = 0; j < 4; j++)
+			work[i].res[j] = &res[j * args.boot_reps];
+
+		task_spawn(boot_worker, &work[i], &grp, NULL);
+	}
+	pool_wait(&grp);
+
+	t->ed_ci.n_reps = args.boot_reps;
+	boot_ci(&res[0 * args.boot_reps], args.boot_reps, t->ed_ci.m);
+	boot_ci(&res[1 * args.boot_reps], args.boot_reps, t->ed_ci.s);
+	boot_ci(&res[2 * args.boot_reps], args.boot_reps, t->ed_ci.a);
+	boot_ci(&res[3 * args.boot_reps], args.boot_reps, t->ed_ci.xceed);
+
+	msg("\t\tBootstrap-%u %.0lf%%: m=[%.4lf %.4lf] s=[%.4lf %.4lf] a=[%.3lf %.3lf]  [%lg %lg]\n",
+	    args.boot_reps, BOOT_CI * 100,
+	    t->ed_ci.m[0], t->ed_ci.m[1], t->ed_ci.s[0], t->ed_ci.s[1],
+	    t->ed_ci.a[0], t->ed_ci.a[1],
+	    t->ed_ci.xceed[0], t->ed_ci.xceed[1]);
+
+	free(work);
+	free(res);
+}
@@ -0,0 +1,361 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Change points in svt blocks.  Two detectors, each splits the trace into
+ * segments on block boundaries:
+ *
+ *  - ph: two-sided Page-Hinkley on block means and on log block variances,
+ *    fed a block at a time as svt stats come in (while decoding for live
+ *    inputs).  Deviations are scaled by the stdev of the series over the
+ *    current segment, an alarm above --cpd-threshold starts a new segment
+ *    where the cumulative sum turned and the blocks since are fed again;
+ *  - pelt: optimal partitioning of block means (Killick et al. 2012),
+ *    normal likelihood with both mean and variance free per segment and
+ *    a BIC penalty.  The set of candidate segment starts is capped so the
+ *    cost stays linear in # of blocks.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define CPD_DRIFT	0.5 /* stdevs tolerated before the sums grow */
+#define CPD_WARMUP	16 /* blocks to estimate the scale from */
+#define CPD_MIN_SEG	4 /* blocks, for pelt */
+#define CPD_MAX_CAND	128 /* pelt candidates kept */
+#define CPD_VAR_FLOOR	1e-2 /* of scaled block means, for pelt */
+
+const char *cpd_names[] = {
+	"ph", "pelt",
+};
+
+struct ph_series {
+	u32 n;
+	double mean, m2; /* Welford over the segment */
+	double up, up_min; /* sums of deviations above, below drift */
+	double dn, dn_max;
+	u32 up_at, dn_at; /* block after the extremes */
+};
+
+struct cpd {
+	u32 next; /* block to be fed next */
+	u32 start; /* of the current segment */
+	struct ph_series s[2]; /* mean, log variance */
+};
+
+static void cp_add(u32 **cps, u32 block)
+{
+	u32 n = tal_count(*cps);
+
+	tal_locked(tal_resize(cps, n + 1));
+	(*cps)[n] = block;
+}
+
+static void ph_reset(struct cpd *c, u32 start)
+{
+	memset(c->s, 0, sizeof(c->s));
+	c->s[0].up_at = c->s[0].dn_at = start;
+	c->s[1].up_at = c->s[1].dn_at = start;
+	c->start = start;
+}
+
+/* Returns the first block of a new segment or 0 if @x fits the current. */
+static u32 ph_feed(struct ph_series *s, double x, u32 b)
+{
+	double dev, sd, z;
+
+	s->n++;
+	dev = x - s->mean;
+	s->mean += dev / s->n;
+	s->m2 += dev * (x - s->mean);
+	if (s->n <= CPD_WARMUP) {
+		s->up_at = s->dn_at = b + 1;
+		return 0;
+	}
+
+	sd = sqrt(s->m2 / (s->n - 1));
+	z = dev / (sd > 1e-9 ? sd : 1e-9);
+
+	s->up += z - CPD_DRIFT;
+	if (s->up < s->up_min) {
+		s->up_min = s->up;
+		s->up_at = b + 1;
+	}
+	s->dn += z + CPD_DRIFT;
+	if (s->dn > s->dn_max) {
+		s->dn_max = s->dn;
+		s->dn_at = b + 1;
+	}
+
+	if (s->up - s->up_min > args.cpd_thr)
+		return s->up_at <= b ? s->up_at : b;
+	if (s->dn_max - s->dn > args.cpd_thr)
+		return s->dn_at <= b ? s->dn_at : b;
+	return 0;
+}
+
+static double log_var(const struct stats_vs_time *svt)
+{
+	return log(svt->stdev * svt->stdev + 1);
+}
+
+/* Feed svt block @b of @t to the online detector, blocks come in order. */
+void cpd_block(struct trace *t, u32 b)
+{
+	struct cpd *c = t->cpd_;
+	u32 i, cp, cp1;
+
+	if (!c) {
+		c = t->cpd_ = tal_locked(talz(t->d, struct cpd));
+		t->cps[CPD_PH] = tal_locked(tal_arr(t->d, u32, 1));
+		t->cps[CPD_PH][0] = 0;
+	}
+
+	for (i = c->next; i <= b; i++) {
+		cp = ph_feed(&c->s[0], t->svt_stats[i].mean, i);
+		cp1 = ph_feed(&c->s[1], log_var(&t->svt_stats[i]), i);
+		if (!cp || (cp1 && cp1 < cp))
+			cp = cp1;
+		if (!cp || cp <= c->start)
+			continue;
+
+		cp_add(&t->cps[CPD_PH], cp);
+		ph_reset(c, cp);
+		i = cp - 1;
+	}
+	c->next = b + 1;
+}
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* Scale of block means robust to the shifts we look for: MAD of first
+ * differences, which have twice the variance.  Only used to keep the
+ * variance floor of segments meaningful.
+ */
+static double pelt_noise(const struct trace *t, u32 n)
+{
+	double *diff, sd;
+	u32 i;
+
+	diff = tal_locked(tal_arr(NULL, double, n - 1));
+	for (i = 1; i < n; i++)
+		diff[i - 1] = fabs(t->svt_stats[i].mean -
+				   t->svt_stats[i - 1].mean);
+	qsort(diff, n - 1, sizeof(*diff), dbl_cmp);
+	sd = diff[(n - 1) / 2] / 0.6745 / M_SQRT2;
+	tal_locked(tal_free(diff));
+
+	return sd;
+}
+
+/* -2 log-likelihood of blocks [a, b) with their own mean and variance */
+static double seg_cost(const double *s1, const double *s2, u32 a, u32 b)
+{
+	const double m = b - a;
+	double var;
+
+	var = (s2[b] - s2[a] - (s1[b] - s1[a]) * (s1[b] - s1[a]) / m) / m;
+	if (var < CPD_VAR_FLOOR)
+		var = CPD_VAR_FLOOR;
+
+	return m * (log(2 * M_PI * var) + 1);
+}
+
+static void calc_pelt(struct trace *t, u32 n)
+{
+	double *s1, *s2, *f, *cost, beta, sd, worst;
+	u32 *last, *cand, n_cand, i, j, k, tau, w;
+	u32 *cps;
+
+	t->cps[CPD_PELT] = tal_locked(tal_arr(t->d, u32, 1));
+	t->cps[CPD_PELT][0] = 0;
+	if (n < 2 * CPD_MIN_SEG)
+		return;
+
+	sd = pelt_noise(t, n);
+	if (sd < 1e-9)
+		return;
+
+	s1 = tal_locked(tal_arr(NULL, double, n + 1));
+	s2 = tal_locked(tal_arr(NULL, double, n + 1));
+	f = tal_locked(tal_arr(NULL, double, n + 1));
+	last = tal_locked(tal_arr(NULL, u32, n + 1));
+	cand = tal_locked(tal_arr(NULL, u32, CPD_MAX_CAND));
+	cost = tal_locked(tal_arr(NULL, double, CPD_MAX_CAND));
+
+	s1[0] = s2[0] = 0;
+	for (i = 0; i < n; i++) {
+		double x = t->svt_stats[i].mean / sd;
+
+		s1[i + 1] = s1[i] + x;
+		s2[i + 1] = s2[i] + x * x;
+	}
+	beta = 3 * log(n);
+	f[0] = -beta;
+	cand[0] = 0;
+	n_cand = 1;
+
+	for (i = 1; i <= n; i++) {
+		f[i] = INFINITY;
+		last[i] = 0;
+		for (j = 0; j < n_cand; j++) {
+			tau = cand[j];
+			if (i - tau < CPD_MIN_SEG) {
+				cost[j] = -INFINITY;
+				continue;
+			}
+			cost[j] = f[tau] + seg_cost(s1, s2, tau, i);
+			if (cost[j] + beta < f[i]) {
+				f[i] = cost[j] + beta;
+				last[i] = tau;
+			}
+		}
+		if (isinf(f[i]))
+			continue;
+
+		/* prune, over the cap also drop the least promising one */
+		w = n_cand;
+		worst = -INFINITY;
+		for (j = 0, k = 0; j < n_cand; j++) {
+			if (cost[j] > f[i])
+				continue;
+			if (cost[j] > worst) {
+				worst = cost[j];
+				w = k;
+			}
+			cand[k++] = cand[j];
+		}
+		n_cand = k;
+		if (n_cand == CPD_MAX_CAND && w < n_cand) {
+			memmove(&cand[w], &cand[w + 1],
+				(n_cand - w - 1) * sizeof(*cand));
+			n_cand--;
+		}
+		cand[n_cand++] = i;
+	}
+
+	/* walk back from the end, segment starts come out reversed */
+	cps = tal_locked(tal_arr(NULL, u32, 0));
+	for (i = n; i && last[i]; i = last[i])
+		cp_add(&cps, last[i]);
+	k = tal_count(cps);
+	tal_locked(tal_resize(&t->cps[CPD_PELT], k + 1));
+	for (j = 0; j < k; j++)
+		t->cps[CPD_PELT][j + 1] = cps[k - 1 - j];
+
+	tal_locked(tal_free(cps));
+	tal_locked(tal_free(cost));
+	tal_locked(tal_free(cand));
+	tal_locked(tal_free(last));
+	tal_locked(tal_free(f));
+	tal_locked(tal_free(s2));
+	tal_locked(tal_free(s1));
+}
+
+/* Feed blocks online stages haven't, run pelt over all of them. */
+void calc_changes(struct trace *t)
+{
+	const u32 n = t->d->n_samples / args.svt_block;
+
+	if (n)
+		cpd_block(t, n - 1);
+	else if (!t->cps[CPD_PH]) {
+		t->cps[CPD_PH] = tal_locked(tal_arr(t->d, u32, 1));
+		t->cps[CPD_PH][0] = 0;
+	}
+	tal_locked(tal_free(t->cpd_));
+	t->cpd_ = NULL;
+
+	calc_pelt(t, n);
+}
+
+static void write_segment(const struct trace *t, enum cpd_method m,
+			  u32 first, u32 end, struct wbuf *w)
+{
+	const struct stats_vs_time *svt = t->svt_stats;
+	const u32 bs = args.svt_block;
+	const u64 n = (u64)(end - first) * bs;
+	u32 i, min = ~0U, max = 0;
+	double sum = 0, ss = 0, mean;
+
+	for (i = first; i < end; i++) {
+		sum += svt[i].sum;
+		if (svt[i].min < min)
+			min = svt[i].min;
+		if (svt[i].max > max)
+			max = svt[i].max;
+	}
+	mean = sum / n;
+	for (i = first; i < end; i++)
+		ss += svt[i].stdev_sum +
+			bs * (svt[i].mean - mean) * (svt[i].mean - mean);
+
+	if (w->fmt == FMT_TEXT) {
+		wb_printf(w, "%d %s %u %u ", (int)(t - t->d->t), cpd_names[m],
+			  first * bs, end * bs);
+		wb_dbl(w, mean, 'e');
+		wb_char(w, ' ');
+		wb_dbl(w, n > 1 ? sqrt(ss / (n - 1)) : 0, 'e');
+		wb_printf(w, " %u %u", min, max);
+	} else {
+		wb_dbl(w, t - t->d->t, 'e');
+		wb_dbl(w, m, 'e');
+		wb_dbl(w, first * bs, 'e');
+		wb_dbl(w, end * bs, 'e');
+		wb_dbl(w, mean, 'e');
+		wb_dbl(w, n > 1 ? sqrt(ss / (n - 1)) : 0, 'e');
+		wb_dbl(w, min, 'e');
+		wb_dbl(w, max, 'e');
+	}
+	wb_eol(w);
+}
+
+/* "trace detector first_sample end_sample mean stdev min max" per segment,
+ * binary formats get all columns as doubles.
+ */
+int write_changes(const struct delay *d, struct wbuf *w)
+{
+	const u32 n_blocks = d->n_samples / args.svt_block;
+	const struct trace *t;
+	u32 i, n;
+	int m;
+
+	wb_begin(w, "<f8", 8);
+	if (!n_blocks)
+		return 0;
+
+	for_each_trace(d, t)
+		for (m = 0; m < CPD_N; m++) {
+			if (!t->cps[m])
+				continue;
+			n = tal_count(t->cps[m]);
+			for (i = 0; i < n; i++)
+				write_segment(t, m, t->cps[m][i],
+					      i + 1 < n ? t->cps[m][i + 1] :
+					      n_blocks, w);
+		}
+
+	return 0;
+}
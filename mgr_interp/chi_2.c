@@ -15,6 +15,8 @@
  * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
  */
 
+#include <math.h>
+
 float chi2_table[] = {
 	/*   0 */    0.0,    3.841,   5.991,   7.815,   9.488,
 	/*   5 */  11.070,  12.592,  14.067,  15.507,  16.919,
@@ -68,27 +70,22 @@ float chi2_table[] = {
 	/* 245 */ 282.511, 283.586, 284.660, 285.734, 286.808,
 };
 
-float chi2_table_big[] = {
-	/*  250 */  287.882, 341.395, 394.626, 447.632, 500.456,
-	/*  500 */  553.127, 605.667, 658.094, 710.421, 762.661,
-	/*  750 */  814.822, 866.911, 918.937, 970.904, 1022.816,
-	/* 1000 */ 1074.679,
-};
-
 unsigned long chi2_table_len = sizeof(chi2_table)/sizeof(chi2_table[0]);
-unsigned long chi2_table_big_len =
-	sizeof(chi2_table_big)/sizeof(chi2_table_big[0]);
 
+/* Upper 5% point of the standard normal, for Wilson-Hilferty. */
+#define CHI2_Z_95 1.6448536
+
+/* Critical values of chi^2 at 5%, tabled up to 250 df, above that the
+ * Wilson-Hilferty cube approximation is good to ~1e-3 relative.
+ */
 float chi2_read(unsigned df)
 {
+	double h;
+
 	if (df < chi2_table_len)
 		return chi2_table[df];
 
-	df -= chi2_table_len;
-	df /= 50;
-
-	if (df < chi2_table_big_len)
-		return chi2_table_big[df];
+	h = 2.0 / (9 * df);
 
-	return -1;
+	return df * pow(1 - h + CHI2_Z_95 * sqrt(h), 3);
 }
@@ -0,0 +1,290 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* A/B comparison of two result banks (e.g. two kernels).  Histograms of
+ * each side are merged into dense tables over the common value range and
+ * all two-sample tests walk those tables once, samples are never sorted.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define CMP_ALPHA	0.01
+/* |Cliff's delta| below this is a negligible effect (Romano et al.) */
+#define CMP_MIN_EFFECT	0.147
+
+struct cmp_side {
+	u64 *cnt; /* dense, indexed by val - min */
+	u64 n;
+	double mean;
+};
+
+struct cmp_res {
+	double ks_d, ks_p;
+	double ad_t, ad_p;
+	double mw_z, mw_p;
+	double cliff;
+};
+
+static void cmp_side_fill(struct cmp_side *cs, const struct delay_bank *db,
+			  int tr, u32 min, u32 len)
+{
+	const struct distribution *di;
+	double sum = 0;
+	int i;
+	u32 j;
+
+	cs->cnt = tal_arrz(NULL, u64, len);
+	cs->n = 0;
+
+	for (i = 0; i < db->n; i++) {
+		di = db->bank[i]->t[tr].distr;
+		for (j = 0; j < tal_count(di); j++) {
+			cs->cnt[di[j].val - min] += di[j].cnt;
+			sum += (double)di[j].val * di[j].cnt;
+			cs->n += di[j].cnt;
+		}
+	}
+
+	cs->mean = cs->n ? sum / cs->n : 0;
+}
+
+static u32 cmp_side_pct(const struct cmp_side *cs, u32 min, u32 len, double q)
+{
+	u64 acc = 0;
+	u32 j;
+
+	for (j = 0; j < len; j++) {
+		acc += cs->cnt[j];
+		if (acc >= q * cs->n)
+			return min + j;
+	}
+
+	return min + len - 1;
+}
+
+/* Asymptotic Kolmogorov distribution, Stephens' small sample correction */
+static double ks_p(double d, double ne)
+{
+	const double lambda = (sqrt(ne) + 0.12 + 0.11 / sqrt(ne)) * d;
+	double sum = 0, term;
+	int k;
+
+	if (lambda < 0.2)
+		return 1;
+
+	for (k = 1; k <= 100; k++) {
+		term = 2 * exp(-2 * k * k * lambda * lambda);
+		sum += k & 1 ? term : -term;
+		if (term < 1e-12)
+			break;
+	}
+
+	return sum < 0 ? 0 : sum > 1 ? 1 : sum;
+}
+
+/* Scholz & Stephens k-sample AD, variance of A^2 under H0 for k = 2 */
+static double ad_sigma(double n1, double n2)
+{
+	const double N = n1 + n2, k = 2, H = 1/n1 + 1/n2;
+	double h, g, a, b, c, d;
+	u64 i;
+
+	if (N < 4)
+		return 1;
+
+	if (N < 100000) {
+		double *hh = malloc(N * sizeof(*hh));
+
+		/* hh[i] = sum_{j=1}^{i} 1/j */
+		hh[0] = 0;
+		for (i = 1; i < N; i++)
+			hh[i] = hh[i-1] + 1.0 / i;
+		h = hh[(u64)N - 1];
+		for (g = 0, i = 1; i <= N - 2; i++)
+			g += (h - hh[i]) / (N - i);
+		free(hh);
+	} else {
+		h = log(N - 1) + 0.5772156649 + 1 / (2 * (N - 1));
+		g = M_PI * M_PI / 6;
+	}
+
+	a = (4*g - 6) * (k - 1) + (10 - 6*g) * H;
+	b = (2*g - 4) * k*k + 8*h*k + (2*g - 14*h - 4) * H - 8*h + 4*g - 6;
+	c = (6*h + 2*g - 2) * k*k + (4*h - 4*g + 6) * k + (2*h - 6) * H + 4*h;
+	d = (2*h + 6) * k*k - 4*h*k;
+
+	return sqrt((a*N*N*N + b*N*N + c*N + d) / ((N - 1) * (N - 2) * (N - 3)));
+}
+
+/* Critical values of the standardised statistic for k - 1 = 1 */
+static const double ad_crit_p[] = {
+	0.25, 0.10, 0.05, 0.025, 0.01, 0.005, 0.001,
+};
+static const double ad_crit_t[] = {
+	0.325, 1.226, 1.961, 2.718, 3.752, 4.592, 6.546,
+};
+
+static double ad_p(double t)
+{
+	const u32 n = sizeof(ad_crit_t)/sizeof(ad_crit_t[0]);
+	double w;
+	u32 i;
+
+	if (t <= ad_crit_t[0])
+		return ad_crit_p[0];
+	if (t >= ad_crit_t[n - 1])
+		return ad_crit_p[n - 1];
+
+	for (i = 1; t > ad_crit_t[i]; i++)
+		;
+	w = (t - ad_crit_t[i-1]) / (ad_crit_t[i] - ad_crit_t[i-1]);
+
+	return exp(log(ad_crit_p[i-1]) * (1 - w) + log(ad_crit_p[i]) * w);
+}
+
+/* One pass over the value range computes KS, AD (midrank version for
+ * ties) and Mann-Whitney U with tie correction.
+ */
+static void cmp_tests(const struct cmp_side *s1, const struct cmp_side *s2,
+		      u32 len, struct cmp_res *res)
+{
+	const double n1 = s1->n, n2 = s2->n, N = n1 + n2;
+	double f1 = 0, f2 = 0, d;
+	double B = 0, Ba, M1a, M2a, l, den;
+	double ad = 0, r1 = 0, ties = 0, u1, mw_var;
+	u32 j;
+
+	res->ks_d = 0;
+
+	for (j = 0; j < len; j++) {
+		l = s1->cnt[j] + s2->cnt[j];
+		if (!l)
+			continue;
+
+		/* AD and MW need counts below and half of the ties */
+		Ba = B + l / 2;
+		M1a = f1 + s1->cnt[j] / 2.0;
+		M2a = f2 + s2->cnt[j] / 2.0;
+		den = Ba * (N - Ba) - N * l / 4;
+		if (den > 0)
+			ad += l * ((N*M1a - n1*Ba) * (N*M1a - n1*Ba) / n1 +
+				   (N*M2a - n2*Ba) * (N*M2a - n2*Ba) / n2) / den;
+
+		r1 += s1->cnt[j] * (B + (l + 1) / 2);
+		ties += l * l * l - l;
+
+		B += l;
+		f1 += s1->cnt[j];
+		f2 += s2->cnt[j];
+
+		d = fabs(f1 / n1 - f2 / n2);
+		if (d > res->ks_d)
+			res->ks_d = d;
+	}
+
+	res->ks_p = ks_p(res->ks_d, n1 * n2 / N);
+
+	ad *= (N - 1) / (N * N);
+	res->ad_t = (ad - 1) / ad_sigma(n1, n2);
+	res->ad_p = ad_p(res->ad_t);
+
+	u1 = r1 - n1 * (n1 + 1) / 2;
+	mw_var = n1 * n2 / 12 * ((N + 1) - ties / (N * (N - 1)));
+	res->mw_z = mw_var > 0 ? (u1 - n1 * n2 / 2) / sqrt(mw_var) : 0;
+	res->mw_p = erfc(fabs(res->mw_z) / M_SQRT2);
+
+	/* P(a > b) - P(a < b), positive when A is slower */
+	res->cliff = 2 * u1 / (n1 * n2) - 1;
+}
+
+static void cmp_bank_range(const struct delay_bank *db, int tr,
+			   u32 *min, u32 *max)
+{
+	int i;
+
+	for (i = 0; i < db->n; i++) {
+		if (!db->bank[i]->n_samples)
+			continue;
+		if (db->bank[i]->t[tr].min < *min)
+			*min = db->bank[i]->t[tr].min;
+		if (db->bank[i]->t[tr].max > *max)
+			*max = db->bank[i]->t[tr].max;
+	}
+}
+
+void compare_banks(const struct delay_bank *a, const struct delay_bank *b)
+{
+	struct cmp_side sa, sb;
+	struct cmp_res res;
+	const char *verdict;
+	u32 min, max, len;
+	int tr;
+
+	printf(FBOLD "Comparing %d files (A) with %d files (B)\n" FNORM,
+	       a->n, b->n);
+
+	for (tr = 0; tr < (int)args.n_traces; tr++) {
+		min = -1;
+		max = 0;
+		cmp_bank_range(a, tr, &min, &max);
+		cmp_bank_range(b, tr, &min, &max);
+		if (min > max)
+			continue;
+		len = max - min + 1;
+
+		cmp_side_fill(&sa, a, tr, min, len);
+		cmp_side_fill(&sb, b, tr, min, len);
+		if (!sa.n || !sb.n) {
+			err("Trace %d: no samples on one side\n", tr);
+			goto next;
+		}
+
+		cmp_tests(&sa, &sb, len, &res);
+
+		if (res.ad_p >= CMP_ALPHA || fabs(res.cliff) < CMP_MIN_EFFECT)
+			verdict = FGRN "same";
+		else if (res.cliff < 0)
+			verdict = FRED "B slower";
+		else
+			verdict = FYLW "B faster";
+
+		printf("Trace %d: A n=%" PRIu64 " mean %lf p50 %u p99 %u\t"
+		       "B n=%" PRIu64 " mean %lf p50 %u p99 %u\n", tr,
+		       sa.n, sa.mean, cmp_side_pct(&sa, min, len, 0.5),
+		       cmp_side_pct(&sa, min, len, 0.99),
+		       sb.n, sb.mean, cmp_side_pct(&sb, min, len, 0.5),
+		       cmp_side_pct(&sb, min, len, 0.99));
+		printf("\tKS D=%lf p=%lg  AD T=%lf p=%lg  MW z=%lf p=%lg\n",
+		       res.ks_d, res.ks_p, res.ad_t, res.ad_p,
+		       res.mw_z, res.mw_p);
+		printf("\tB-A: mean %+lf p50 %+d p99 %+d  cliff's delta %+lf  -> %s\n"
+		       FNORM, sb.mean - sa.mean,
+		       (int)(cmp_side_pct(&sb, min, len, 0.5) -
+			     cmp_side_pct(&sa, min, len, 0.5)),
+		       (int)(cmp_side_pct(&sb, min, len, 0.99) -
+			     cmp_side_pct(&sa, min, len, 0.99)),
+		       -res.cliff, verdict);
+next:
+		tal_free(sa.cnt);
+		tal_free(sb.cnt);
+	}
+}
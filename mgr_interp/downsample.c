@@ -0,0 +1,169 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Downsampled traces for plotting.  Samples are split into @width columns,
+ * each gets min, max and mean of t0 and t1 plus one point per trace picked
+ * with Largest-Triangle-Three-Buckets (Steinarsson 2013): the point forming
+ * the largest triangle with the previous pick and the next column's mean.
+ * Columns are walked once, the pick for a column is made right after the
+ * next column's mean is known, while its samples are still in cache.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+
+struct ds_col {
+	u32 first; /* sample index */
+	u32 end;
+	u32 min[2];
+	u32 max[2];
+	double mean[2];
+	u32 pick[2]; /* sample index */
+	u32 pick_val[2];
+};
+
+static void ds_envelope(const struct delay *d, struct ds_col *c)
+{
+	u64 sum[2] = {};
+	u32 i, j, v;
+
+	for (j = 0; j < 2; j++) {
+		c->min[j] = ~0U;
+		c->max[j] = 0;
+	}
+
+	for (i = c->first; i < c->end; i++)
+		for (j = 0; j < 2; j++) {
+			v = d->t[j].samples[i];
+			sum[j] += v;
+			if (c->min[j] > v)
+				c->min[j] = v;
+			if (c->max[j] < v)
+				c->max[j] = v;
+		}
+
+	for (j = 0; j < 2; j++)
+		c->mean[j] = (double)sum[j] / (c->end - c->first);
+}
+
+/* Pick the point of @c making the largest triangle with @prev and @next's
+ * mean.  The first and last column are pinned to the first and last sample.
+ */
+static void ds_lttb(const struct delay *d, struct ds_col *c,
+		    const struct ds_col *prev, const struct ds_col *next)
+{
+	double ax, ay, bx, by, area, best;
+	u32 i, j;
+
+	for (j = 0; j < 2; j++) {
+		if (!prev || !next) {
+			c->pick[j] = prev ? c->end - 1 : c->first;
+			continue;
+		}
+
+		ax = prev->pick[j];
+		ay = d->t[j].samples[prev->pick[j]];
+		bx = (next->first + next->end - 1) / 2.0;
+		by = next->mean[j];
+
+		best = -1;
+		for (i = c->first; i < c->end; i++) {
+			area = fabs((ax - bx) * (d->t[j].samples[i] - ay) -
+				    (ax - i) * (by - ay));
+			if (area > best) {
+				best = area;
+				c->pick[j] = i;
+			}
+		}
+	}
+
+	for (j = 0; j < 2; j++)
+		c->pick_val[j] = d->t[j].samples[c->pick[j]];
+}
+
+static void ds_write(struct wbuf *w, const struct ds_col *c)
+{
+	const bool text = w->fmt == FMT_TEXT;
+	u32 j;
+
+	if (text)
+		wb_u32(w, c->first);
+	else
+		wb_dbl(w, c->first, 'e');
+
+	for (j = 0; j < 2; j++) {
+		wb_char(w, ' ');
+		if (text) {
+			wb_u32(w, c->min[j]);
+			wb_char(w, ' ');
+			wb_u32(w, c->max[j]);
+		} else {
+			wb_dbl(w, c->min[j], 'e');
+			wb_dbl(w, c->max[j], 'e');
+		}
+		wb_char(w, ' ');
+		wb_dbl(w, c->mean[j], 'f');
+		wb_char(w, ' ');
+		if (text) {
+			wb_u32(w, c->pick[j]);
+			wb_char(w, ' ');
+			wb_u32(w, c->pick_val[j]);
+		} else {
+			wb_dbl(w, c->pick[j], 'e');
+			wb_dbl(w, c->pick_val[j], 'e');
+		}
+	}
+	wb_eol(w);
+}
+
+/* Binary formats get all columns as doubles. */
+int write_downsampled(const struct delay *d, struct wbuf *w, u32 width)
+{
+	struct ds_col col[3], *prev = NULL, *cur, *next;
+	u32 n = d->n_samples, c;
+
+	if (!n)
+		return 0;
+	if (!width || width > n)
+		width = n;
+
+	wb_begin(w, "<f8", 1 + 2 * 5);
+
+	cur = &col[0];
+	cur->first = 0;
+	cur->end = (u64)n / width;
+	ds_envelope(d, cur);
+
+	for (c = 1; c <= width; c++) {
+		next = NULL;
+		if (c < width) {
+			next = &col[c % 3];
+			next->first = cur->end;
+			next->end = (u64)n * (c + 1) / width;
+			ds_envelope(d, next);
+		}
+
+		ds_lttb(d, cur, prev, next);
+		ds_write(w, cur);
+
+		prev = cur;
+		cur = next;
+	}
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Event index.  The parser appends anomalies as it meets them, one array
+ * per event type, so every array is sorted by result # without any effort.
+ * Range queries are a binary search plus a walk over the matching events,
+ * samples are never touched.
+ */
+
+#include "mgr_interp.h"
+
+#include <ccan/tal/tal.h>
+
+const char *event_names[EV_N] = {
+	"notif", "skip", "fixup", "ifg", "xceed0", "xceed1", "xceed2",
+	"xceed3", "xceed4", "xceed5", "xceed6", "xceed7", "xceed8", "xceed9",
+};
+
+void event_add(struct delay *d, enum event_type type, u32 res, u32 val)
+{
+	struct event_index *ei = d->events;
+	struct event *ev;
+
+	if (unlikely(!ei))
+		ei = d->events = tal_locked(talz(d, struct event_index));
+
+	if (ei->n[type] == tal_count(ei->ev[type])) {
+		if (!ei->ev[type])
+			ei->ev[type] = tal_locked(tal_arr(ei, struct event,
+							   64));
+		else
+			tal_locked(tal_resize(&ei->ev[type], ei->n[type] * 2));
+	}
+
+	ev = &ei->ev[type][ei->n[type]++];
+	ev->res = res;
+	ev->sample = d->n_samples;
+	ev->val = val;
+}
+
+u32 event_count(const struct delay *d, enum event_type type)
+{
+	return d->events ? d->events->n[type] : 0;
+}
+
+/* Index of the first event of @type at result @res or later */
+u32 event_lower_bound(const struct delay *d, enum event_type type, u32 res)
+{
+	const struct event *ev;
+	u32 lo = 0, hi = event_count(d, type), mid;
+
+	if (!hi)
+		return 0;
+
+	ev = d->events->ev[type];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ev[mid].res < res)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* All events as one timeline, "type result sample value" per row.  Text
+ * has the type's name, binary formats its index.
+ */
+int write_events(const struct delay *d, struct wbuf *w)
+{
+	const struct event_index *ei = d->events;
+	const struct event *ev;
+	u32 pos[EV_N] = {}, best;
+	int i, type;
+
+	wb_begin(w, "<u4", 4);
+	if (!ei)
+		return 0;
+
+	while (true) {
+		type = -1;
+		for (i = 0; i < EV_N; i++)
+			if (pos[i] < ei->n[i] &&
+			    (type < 0 || ei->ev[i][pos[i]].res < best)) {
+				type = i;
+				best = ei->ev[i][pos[i]].res;
+			}
+		if (type < 0)
+			break;
+
+		ev = &ei->ev[type][pos[type]++];
+		if (w->fmt == FMT_TEXT)
+			wb_printf(w, "%s", event_names[type]);
+		else
+			wb_u32(w, type);
+		wb_char(w, ' ');
+		wb_u32(w, ev->res);
+		wb_char(w, ' ');
+		wb_u32(w, ev->sample);
+		wb_char(w, ' ');
+		wb_s32(w, ev->val);
+		wb_eol(w);
+	}
+
+	return 0;
+}
+
+/* Exceedances of trace @tr closer than @gap results apart make one period,
+ * "first last # max" per period.
+ */
+void write_bad_periods(const struct delay *d, u32 tr, u32 gap,
+		       u32 from, u32 to, struct wbuf *w)
+{
+	const enum event_type type = EV_XCEED0 + tr;
+	const u32 n = event_count(d, type);
+	const struct event *ev;
+	u32 i, first = 0, last = 0, cnt = 0, max = 0;
+
+	wb_begin(w, "<u4", 4);
+
+	for (i = event_lower_bound(d, type, from); i <= n; i++) {
+		ev = i < n ? &d->events->ev[type][i] : NULL;
+		if (ev && ev->res > to)
+			ev = NULL;
+
+		if (cnt && (!ev || ev->res - last > gap)) {
+			wb_u32(w, first);
+			wb_char(w, ' ');
+			wb_u32(w, last);
+			wb_char(w, ' ');
+			wb_u32(w, cnt);
+			wb_char(w, ' ');
+			wb_u32(w, max);
+			wb_eol(w);
+			cnt = 0;
+		}
+		if (!ev)
+			break;
+
+		if (!cnt) {
+			first = ev->res;
+			max = 0;
+		}
+		last = ev->res;
+		cnt++;
+		if (ev->val > max)
+			max = ev->val;
+	}
+}
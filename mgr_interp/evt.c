@@ -0,0 +1,731 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+#include "mgr_interp.h"
+
+#include <assert.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define VEC_SZ (1 << 5)
+
+#define FIT_FRAC 1
+
+#define CHI_MIN_BUCKETS 6
+#define CHI_MIN_IN_BUCKET 5
+
+static int cmp_u32(const void *a1, const void *a2)
+{
+	const u32 *u1 = a1, *u2 = a2;
+	return *u1 - *u2;
+}
+
+const char *evt_family_names[] = {
+	[EVT_GUMBEL]	= "gumbel",
+	[EVT_FRECHET]	= "frechet",
+	[EVT_GEV]	= "gev",
+	[EVT_ALL]	= "all",
+};
+
+const char *gof_names[] = {
+	[GOF_AD]	= "ad",
+	[GOF_KS]	= "ks",
+	[GOF_CHI2]	= "chi2",
+};
+
+/* Per-family kernels.  They are always inlined with a constant @fam so
+ * the switch disappears and every family gets its own specialised loop,
+ * see fit_quality().  For GEV a is the shape (xi), for Frechet alpha.
+ */
+static inline __attribute__((always_inline))
+double evt_logf_(const enum evt_family fam,
+		 double x, double a, double s, double m)
+{
+	const double scaled = (x - m) / s;
+	double powed, tt;
+
+	switch (fam) {
+	case EVT_FRECHET:
+		powed = pow(scaled, -a);
+
+		return log(a/s * powed/scaled) - powed;
+	case EVT_GEV:
+		if (fabs(a) < 1e-9)
+			return -log(s) - (scaled + exp(-scaled));
+
+		tt = 1 + a * scaled;
+		if (tt <= 0)
+			return -INFINITY;
+		powed = pow(tt, -1/a);
+
+		return -log(s) + log(powed/tt) - powed;
+	case EVT_GUMBEL:
+	default:
+		return -log(s) - (scaled + exp(-scaled));
+	}
+}
+
+double evt_cdf(const struct evt_distr *ed, double x)
+{
+	const double scaled = (x - ed->m) / ed->s;
+	double tt;
+
+	switch (ed->family) {
+	case EVT_FRECHET:
+		return exp(-pow(scaled, -ed->a));
+	case EVT_GEV:
+		if (fabs(ed->a) < 1e-9)
+			return exp(-exp(-scaled));
+
+		tt = 1 + ed->a * scaled;
+		if (tt <= 0)
+			return ed->a > 0 ? 0 : 1;
+
+		return exp(-pow(tt, -1/ed->a));
+	case EVT_GUMBEL:
+	default:
+		return exp(-exp(-scaled));
+	}
+}
+
+/* Value exceeded by a single sample with probability @p. */
+double evt_xceed(const struct evt_distr *ed, double p)
+{
+	const double y = -log(pow(1 - p, ed->block_size));
+
+	switch (ed->family) {
+	case EVT_FRECHET:
+		return ed->m + ed->s * pow(y, -1/ed->a);
+	case EVT_GEV:
+		if (fabs(ed->a) < 1e-9)
+			return ed->m - ed->s * log(y);
+
+		return ed->m + ed->s / ed->a * (pow(y, -ed->a) - 1);
+	case EVT_GUMBEL:
+	default:
+		return ed->m - ed->s * log(y);
+	}
+}
+
+static inline u32 evt_n_params(enum evt_family fam)
+{
+	return fam == EVT_GUMBEL ? 2 : 3;
+}
+
+double evt_aic(const struct evt_distr *ed)
+{
+	return 2 * evt_n_params(ed->family) - 2 * ed->llh;
+}
+
+static inline __attribute__((always_inline))
+double fit_quality_(const enum evt_family fam,
+		    const struct distribution *distr, u32 n,
+		    double a, double s, double m)
+{
+	u32 i;
+	double sum = 0;
+
+	for (i = n; i > 0; i--)
+		sum += distr[i-1].cnt * evt_logf_(fam, distr[i-1].val, a, s, m);
+
+	return sum;
+}
+
+double fit_quality(enum evt_family fam, const struct distribution *distr,
+		   u32 n, double a, double s, double m)
+{
+	switch (fam) {
+	case EVT_FRECHET:
+		return fit_quality_(EVT_FRECHET, distr, n, a, s, m);
+	case EVT_GEV:
+		return fit_quality_(EVT_GEV, distr, n, a, s, m);
+	case EVT_GUMBEL:
+	default:
+		return fit_quality_(EVT_GUMBEL, distr, n, a, s, m);
+	}
+}
+
+/* change this define to msg to get fitting steps debug */
+#define shg dbg
+
+static void shake_m(enum evt_family fam,
+		    const struct distribution *distr, u32 n,
+		    double a, double s, double *m_, const u32 max_retry)
+{
+	double m = *m_;
+	u32 retry = 0;
+	double delta = 4;
+	double old = fit_quality(fam, distr, n, a, s, m);
+	double less, more;
+
+	less = fit_quality(fam, distr, n, a, s, m - delta);
+	more = fit_quality(fam, distr, n, a, s, m + delta);
+
+	while (retry < max_retry) {
+		if (old < less) {
+			shg("r%02d m=%lf \t%le %+le %+le\n", retry, m, old, less - old, more - old);
+			m -= delta;
+			more = old;
+			old = less;
+			less = fit_quality(fam, distr, n, a, s, m - delta);
+		} else if (old < more) {
+			shg("r%02d m=%lf \t%le %+le %+le\n", retry, m, old, less - old, more - old);
+			m += delta;
+			less = old;
+			old = more;
+			more = fit_quality(fam, distr, n, a, s, m + delta);
+		} else {
+			retry++;
+			delta /= 2;
+
+			less = fit_quality(fam, distr, n, a, s, m - delta);
+			more = fit_quality(fam, distr, n, a, s, m + delta);
+		}
+	}
+
+	*m_ = m;
+}
+
+/* Frechet needs a positive shape, GEV likelihood is unbounded below -1. */
+static const double evt_a_min[EVT_N_FAMILIES] = {
+	[EVT_FRECHET]	= 0.0000001,
+	[EVT_GEV]	= -0.9999999,
+};
+
+static bool shake_a(enum evt_family fam,
+		    const struct distribution *distr, u32 n,
+		    double *a_, double s, double m, const u32 max_retry)
+{
+	double a = *a_;
+	bool ret;
+	u32 retry = 0;
+	double delta = fam == EVT_GEV ? 0.125 : 1;
+	double old = fit_quality(fam, distr, n, a, s, m);
+	double less, more;
+
+	if (fam == EVT_GUMBEL)
+		return false;
+
+	less = fit_quality(fam, distr, n, a - delta, s, m);
+	more = fit_quality(fam, distr, n, a + delta, s, m);
+
+	while (retry < max_retry) {
+		if (old < less && a - delta > evt_a_min[fam]) {
+			shg("r%02d a=%lf \t%le %+le %+le\n", retry, a, old, less - old, more - old);
+			a -= delta;
+			more = old;
+			old = less;
+			less = fit_quality(fam, distr, n, a - delta, s, m);
+		} else if (old < more) {
+			shg("r%02d a=%lf \t%le %+le %+le\n", retry, a, old, less - old, more - old);
+			a += delta;
+			less = old;
+			old = more;
+			more = fit_quality(fam, distr, n, a + delta, s, m);
+		} else {
+			retry++;
+			delta /= 2;
+
+			less = fit_quality(fam, distr, n, a - delta, s, m);
+			more = fit_quality(fam, distr, n, a + delta, s, m);
+		}
+	}
+
+	ret = a != *a_;
+	*a_ = a;
+
+	return ret;
+}
+
+static bool shake_s(enum evt_family fam,
+		    const struct distribution *distr, u32 n,
+		    double a, double *s_, double m, const u32 max_retry)
+{
+	double s = *s_;
+	bool ret;
+	u32 retry = 0;
+	double delta = 1;
+	double old = fit_quality(fam, distr, n, a, s, m);
+	double less, more;
+
+	less = fit_quality(fam, distr, n, a, s - delta, m);
+	more = fit_quality(fam, distr, n, a, s + delta, m);
+
+	while (retry < max_retry) {
+		if (old < less && s - delta > 0.0000001) {
+			shg("r%02d s=%lf \t%le %+le %+le\n", retry, s, old, less - old, more - old);
+			s -= delta;
+			more = old;
+			old = less;
+			less = fit_quality(fam, distr, n, a, s - delta, m);
+		} else if (old < more) {
+			shg("r%02d s=%lf \t%le %+le %+le\n", retry, s, old, less - old, more - old);
+			s += delta;
+			less = old;
+			old = more;
+			more = fit_quality(fam, distr, n, a, s + delta, m);
+		} else {
+			retry++;
+			delta /= 2;
+
+			less = fit_quality(fam, distr, n, a, s - delta, m);
+			more = fit_quality(fam, distr, n, a, s + delta, m);
+		}
+	}
+
+	ret = s != *s_;
+	*s_ = s;
+	return ret;
+}
+
+static void evt_init(struct evt_distr *ed, enum evt_family fam,
+		     const struct trace *t)
+{
+	memset(ed, 0, sizeof(*ed));
+
+	ed->family = fam;
+	ed->a = 4;
+	ed->s = t->max - t->min;
+	ed->m = t->min;
+}
+
+/* GEV has a bounded support on both sides depending on the sign of the
+ * shape, starting far away makes the shakes walk into -inf.  Start from
+ * the Gumbel method-of-moments estimate instead.
+ */
+static void evt_init_gev(struct evt_distr *ed,
+			 const struct distribution *distr, u32 n)
+{
+	u32 i;
+	u64 cnt = 0;
+	double sum = 0, sq_sum = 0, mean;
+
+	for (i = 0; i < n; i++) {
+		cnt += distr[i].cnt;
+		sum += (double)distr[i].cnt * distr[i].val;
+	}
+	mean = sum / cnt;
+	for (i = 0; i < n; i++)
+		sq_sum += distr[i].cnt * (distr[i].val - mean) *
+			(distr[i].val - mean);
+
+	ed->a = 0;
+	ed->s = sqrt(6 * sq_sum / cnt) / M_PI ?: 1;
+	ed->m = mean - 0.5772156649 * ed->s;
+}
+
+void fit_evt(struct evt_distr *ed, const struct distribution *distr, u32 n)
+{
+	const enum evt_family fam = ed->family;
+	double a = ed->a, s = ed->s, m = ed->m;
+	u32 retry = 2;
+
+	while (true) {
+		shake_m(fam, distr, n, a, s, &m, retry);
+		if (shake_a(fam, distr, n, &a, s, m, retry))
+			continue;
+		if (shake_s(fam, distr, n, a, &s, m, retry))
+			continue;
+
+		if (++retry > 5)
+			break;
+	}
+
+	ed->m = m;
+	ed->s = s;
+	ed->a = a;
+	ed->llh = fit_quality(fam, distr, n, a, s, m);
+}
+
+static int chi_2_test(struct trace *t, u32 n_maxes,
+		      const struct distribution *distr, u32 n)
+{
+	const u32 range = distr[n - 1].val - distr[0].val;
+	u32 b_cnt = n_maxes/30;
+	float b_width;
+	u32 *bucks;
+	u32 b, i, b_upper, b_sum, b_real;
+	double chi = 0, Ei, left_p = 0, right_p, crit;
+	int ret = 0;
+
+	/* buckets narrower than half a clock */
+	if (b_cnt > 2 * range)
+		b_cnt = 2 * range;
+	if (b_cnt < CHI_MIN_BUCKETS)
+		return 1;
+	b_width = range / (float)b_cnt;
+
+	bucks = calloc(b_cnt, sizeof(*bucks));
+
+	for (b = i = 0; b < b_cnt; b++) {
+		b_upper = distr[0].val + (b + 1) * b_width;
+
+		while (i < n && distr[i].val < b_upper)
+			bucks[b] += distr[i++].cnt;
+	}
+	for (; i < n; i++)
+		bucks[b_cnt - 1] += distr[i].cnt;
+
+#ifdef DEBUG
+	{
+		u32 d_sum = 0;
+
+		b_sum = 0;
+		for (i = 0; i < n; i++)
+			d_sum += distr[i].cnt;
+
+		for (b = 0; b < b_cnt; b++)
+			b_sum += bucks[b];
+
+		assert(b_sum == d_sum);
+	}
+#endif
+
+	b = b_real = 0;
+	while (b < b_cnt) {
+		b_real++;
+
+		for (b_sum = 0; b_sum < CHI_MIN_IN_BUCKET && b < b_cnt; b++)
+			b_sum += bucks[b];
+
+		if (b < b_cnt - 1)
+			right_p = evt_cdf(&t->ed, distr[0].val + b * b_width);
+		else
+			right_p = 1;
+		Ei = n_maxes * (right_p - left_p);
+
+		chi += (b_sum - Ei) * (b_sum - Ei) / Ei;
+
+		dbg("chi %.2lf b:%u %lg l:%.5lf r:%.5lf Ei:%.2lf Oi:%u\tp:%.5lf\n",
+		    chi, b, distr[0].val + b * b_width, left_p, right_p, Ei,
+		    b_sum, (b_sum - Ei) * (b_sum - Ei) / Ei);
+
+		left_p = right_p;
+	}
+
+	if (b_real < CHI_MIN_BUCKETS) {
+		ret = 1;
+		goto out;
+	}
+
+	crit = chi2_read(b_real - 1 - evt_n_params(t->ed.family));
+	msg("\t\tCHI^2 RESULT[%u]: %lg vs. %lg  -> %s\n" FNORM,
+	    b_real, chi, crit, chi < crit ? FGRN "PASS" : FRED "FAIL");
+
+	t->ed.ok = chi < crit;
+out:
+	free(bucks);
+
+	return ret;
+}
+
+/* KS and AD critical values at 5% for the modified statistics with
+ * estimated parameters (Stephens, 1977, extreme value case).
+ */
+#define GOF_KS_CRIT	0.844
+#define GOF_AD_CRIT	0.757
+
+/* Clamp so that the logs in AD stay finite */
+static inline double gof_clamp(double p)
+{
+	return p < 1e-300 ? 1e-300 : p > 1 - 1e-16 ? 1 - 1e-16 : p;
+}
+
+/* One-sample KS and AD in a single pass over the maxima histogram.  All
+ * maxima equal to val share the model cdf taken in the middle of the
+ * [val - 0.5, val + 0.5) cell they were rounded into, so the tie groups
+ * can be summed in closed form.
+ */
+static int gof_test(struct trace *t, u32 n_maxes,
+		    const struct distribution *distr, u32 n)
+{
+	const double sqn = sqrt(n_maxes);
+	double lo, hi, mid, d = 0, ad = 0, ks_mod, ad_mod;
+	u64 j0 = 1, c, below = 0;
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		c = distr[i].cnt;
+		lo = evt_cdf(&t->ed, distr[i].val - 0.5);
+		hi = evt_cdf(&t->ed, distr[i].val + 0.5);
+		mid = gof_clamp((lo + hi) / 2);
+
+		if (fabs((double)below / n_maxes - lo) > d)
+			d = fabs((double)below / n_maxes - lo);
+		below += c;
+		if (fabs((double)below / n_maxes - hi) > d)
+			d = fabs((double)below / n_maxes - hi);
+
+		/* sum over j in [j0, j0 + c) of (2j - 1) and (2n + 1 - 2j) */
+		ad += c * (2 * j0 + c - 2) * log(mid) +
+			c * (2.0 * n_maxes + 2 - 2 * j0 - c) * log1p(-mid);
+		j0 += c;
+	}
+
+	ad = -(double)n_maxes - ad / n_maxes;
+
+	ks_mod = sqn * d * (1 + 0.2 / sqn);
+	ad_mod = ad * (1 + 0.2 / sqn);
+
+	msg("\t\tKS[%u]: %lg vs. %lg  -> %s" FNORM "  AD: %lg vs. %lg  -> %s\n"
+	    FNORM, n_maxes, ks_mod, GOF_KS_CRIT,
+	    ks_mod < GOF_KS_CRIT ? FGRN "PASS" : FRED "FAIL",
+	    ad_mod, GOF_AD_CRIT,
+	    ad_mod < GOF_AD_CRIT ? FGRN "PASS" : FRED "FAIL");
+
+	t->ed.ok = args.gof == GOF_KS ?
+		ks_mod < GOF_KS_CRIT : ad_mod < GOF_AD_CRIT;
+
+	return 0;
+}
+
+/* Expected histogram of @n_maxes maxima of blocks of 2^@b_s samples drawn
+ * from t->distr, i.e. of F^B.  Used for aggregates which have no samples
+ * to take block maxima of.
+ */
+static u32 maxes_from_distr(const struct trace *t, u32 n_samples, u32 b_s,
+			    u32 n_maxes, struct distribution *distr)
+{
+	u32 i, n = 0, cum, prev = 0;
+	u64 acc = 0;
+
+	for (i = 0; i < tal_count(t->distr); i++) {
+		acc += t->distr[i].cnt;
+		cum = round(n_maxes * pow((double)acc / n_samples, 1 << b_s));
+		if (cum <= prev)
+			continue;
+
+		distr[n].val = t->distr[i].val;
+		distr[n].cnt = cum - prev;
+		prev = cum;
+		n++;
+	}
+
+	return n;
+}
+
+void calc_gumbel(struct trace *t, u32 n_samples)
+{
+	u32 i;
+	u32 b_s = 7;
+	u32 *marr;
+	u32 arr_len = n_samples * FIT_FRAC >> b_s;
+	size_t marr_size = arr_len * sizeof(*marr);
+	u32 n_distinct = t->max - t->min + 1;
+	struct distribution *distr;
+	struct evt_distr fits[EVT_N_FAMILIES], *best;
+	enum evt_family fam;
+
+	marr = memalign(VEC_SZ, marr_size);
+	distr = malloc(n_distinct * sizeof(*distr));
+
+	for (fam = 0; fam < EVT_N_FAMILIES; fam++)
+		evt_init(&fits[fam], fam, t);
+	t->ed = fits[args.evt_family == EVT_ALL ? 0 : args.evt_family];
+
+	while (!t->ed.ok) {
+		if (n_samples * FIT_FRAC >> b_s < 32)
+			break;
+
+		arr_len = n_samples * FIT_FRAC >> b_s;
+		if (!t->samples) {
+			n_distinct = maxes_from_distr(t, n_samples, b_s,
+						      arr_len, distr);
+			goto fit;
+		}
+		marr_size = arr_len * sizeof(*marr);
+		memset(marr, 0, marr_size);
+
+#define map_direct(i) (i >> b_s)
+#define map_pos(i) (i % arr_len)
+#define map map_pos
+		for (i = 0; i < arr_len << b_s; i++)
+			if (t->samples[i] > marr[map(i)])
+				marr[map(i)] = t->samples[i];
+#undef map
+		qsort(marr, arr_len, sizeof(*marr), cmp_u32);
+
+		distr[0].val = marr[0];
+		distr[0].cnt = 1;
+		n_distinct = 0;
+		for (i = 1; i < arr_len; i++) {
+			if (distr[n_distinct].val == marr[i]) {
+				distr[n_distinct].cnt++;
+			} else {
+				n_distinct++;
+				distr[n_distinct].cnt = 1;
+				distr[n_distinct].val = marr[i];
+			}
+		}
+		n_distinct++;
+fit:
+
+		/* All families are fitted to the same block maxima. */
+		best = NULL;
+		for (fam = 0; fam < EVT_N_FAMILIES; fam++) {
+			if (args.evt_family != EVT_ALL &&
+			    args.evt_family != fam)
+				continue;
+
+			if (fam == EVT_GEV && !fits[fam].block_size)
+				evt_init_gev(&fits[fam], distr, n_distinct);
+			fit_evt(&fits[fam], distr, n_distinct);
+
+			fits[fam].block_size = 1 << b_s;
+			fits[fam].xceed = evt_xceed(&fits[fam], 0.0001);
+			msg("\t\tEVT-%d %s (%lg): m=%.4lf; s=%.4lf; a=%.3lf  %lg\n",
+			    1 << b_s, evt_family_names[fam], fits[fam].llh,
+			    fits[fam].m, fits[fam].s, fits[fam].a,
+			    fits[fam].xceed);
+
+			if (!best || evt_aic(&fits[fam]) < evt_aic(best))
+				best = &fits[fam];
+		}
+		if (args.evt_family == EVT_ALL)
+			msg("\t\tBest AIC: %s (%lg)\n",
+			    evt_family_names[best->family], evt_aic(best));
+		t->ed = *best;
+
+		if (args.gof == GOF_CHI2 ?
+		    chi_2_test(t, arr_len, distr, n_distinct) :
+		    gof_test(t, arr_len, distr, n_distinct))
+			break;
+
+		b_s++;
+	}
+
+	if (!t->ed.ok)
+		err("Failed to fit distribution\n");
+
+	/* keep the block maxima t->ed was fitted to, bootstrap needs them */
+	if (t->ed.block_size) {
+		t->maxes = tal_locked(tal_arr(t->d, struct distribution,
+					      n_distinct));
+		memcpy(t->maxes, distr, n_distinct * sizeof(*distr));
+	}
+
+	free(marr);
+	free(distr);
+}
+
+
+/* The following code tries to fit all three parameters at the same time.
+ * It usually gives slightly better fits, but it's also slower. To make it
+ * fast make sure computed point-values are reused after move (or retry++).
+ * Beware, it may be Frechet specific! (i.e. the correctness conditions)
+ */
+#if 0
+struct move {
+	double res;
+	s8 gradient[3];
+} moves[27] = {
+	/*  n                     a   s   m    */
+	/*  0 */ { .gradient = { -1, -1, -1 }, },
+	/*  1 */ { .gradient = { -1, -1,  0 }, },
+	/*  2 */ { .gradient = { -1, -1,  1 }, },
+	/*  3 */ { .gradient = { -1,  0, -1 }, },
+	/*  4 */ { .gradient = { -1,  0,  0 }, },
+	/*  5 */ { .gradient = { -1,  0,  1 }, },
+	/*  6 */ { .gradient = { -1,  1, -1 }, },
+	/*  7 */ { .gradient = { -1,  1,  0 }, },
+	/*  8 */ { .gradient = { -1,  1,  1 }, },
+	/*  9 */ { .gradient = {  0, -1, -1 }, },
+	/* 10 */ { .gradient = {  0, -1,  0 }, },
+	/* 11 */ { .gradient = {  0, -1,  1 }, },
+	/* 12 */ { .gradient = {  0,  0, -1 }, },
+	/* 13 */ { .gradient = {  0,  0,  0 }, }, /* [13] -> NO_MOVE */
+	/* 14 */ { .gradient = {  0,  0,  1 }, },
+	/* 15 */ { .gradient = {  0,  1, -1 }, },
+	/* 16 */ { .gradient = {  0,  1,  0 }, },
+	/* 17 */ { .gradient = {  0,  1,  1 }, },
+	/* 18 */ { .gradient = {  1, -1, -1 }, },
+	/* 19 */ { .gradient = {  1, -1,  0 }, },
+	/* 20 */ { .gradient = {  1, -1,  1 }, },
+	/* 21 */ { .gradient = {  1,  0, -1 }, },
+	/* 22 */ { .gradient = {  1,  0,  0 }, },
+	/* 23 */ { .gradient = {  1,  0,  1 }, },
+	/* 24 */ { .gradient = {  1,  1, -1 }, },
+	/* 25 */ { .gradient = {  1,  1,  0 }, },
+	/* 26 */ { .gradient = {  1,  1,  1 }, },
+};
+
+#define NO_MOVE 13
+
+static void shake_all(struct trace *t, struct distribution *distr, u32 n,
+		      double a, double s, double m, const u32 max_retry)
+{
+	u32 i, best_i;
+	u32 retry = 0;
+	double delta = 1, best;
+
+	while (retry < max_retry) {
+		best_i = 30;
+		best = -INFINITY;
+		for (i = 0; i < 27; i++) {
+			if (1.0000001 > a + moves[i].gradient[0] * delta
+			    || 0.0000001 > s + moves[i].gradient[1] * delta)
+			    || t->min < m + moves[i].gradient[2] * delta
+			    || 0 > m + moves[i].gradient[2] * delta)
+				continue;
+
+			moves[i].res =
+				fit_quality(distr, n,
+					    a + moves[i].gradient[0] * delta,
+					    s + moves[i].gradient[1] * delta,
+					    m + moves[i].gradient[2] * delta);
+
+			if (moves[i].res > best) {
+				best = moves[i].res;
+				best_i = i;
+			}
+		}
+
+		assert(best_i < 27);
+
+		dbg("Go   %u(%u) a=%.2lf s=%.2lf m=%.2lf %lf [%le]\n",
+		    best_i, retry, a, s, m,
+		    moves[best_i].res, best - moves[NO_MOVE].res);
+
+		if (best_i != NO_MOVE) {
+			a += moves[best_i].gradient[0] * delta;
+			s += moves[best_i].gradient[1] * delta;
+			m += moves[best_i].gradient[2] * delta;
+
+			delta = 1;
+			retry = 0;
+		} else {
+			delta /= 2;
+			retry++;
+		}
+
+		dbg("Went %u(%u) a=%.2lf s=%.2lf m=%.2lf %lf [%le]\n",
+		    best_i, retry, a, s, m,
+		    moves[best_i].res, best - moves[NO_MOVE].res);
+	}
+
+	msg("Shake all would choose: (%lg) m=%lg; s=%lg; a=%lg\n",
+	    moves[NO_MOVE].res, m, s, a);
+
+	t->ed.a = a;
+	t->ed.s = s;
+	t->ed.m = m;
+}
+#endif
@@ -0,0 +1,258 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Sparse 2D histogram for heatmaps.  Cells are kept in 64x64 tiles which
+ * are only allocated once something lands in them, tiles are found through
+ * a small open addressing hash.  Memory follows the populated cells, not
+ * the min..max span, so a single outlier costs one tile.
+ *
+ * Axes are either linear with @aggr wide cells or logarithmic with @log
+ * cells per octave of the distance from the axis origin, linear close to
+ * the origin so that no cell is narrower than one clock.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define TILE_SHIFT	6
+#define TILE_DIM	(1U << TILE_SHIFT)
+#define TILE_MASK	(TILE_DIM - 1)
+
+struct hm_tile {
+	u32 tx;
+	u32 ty;
+	u32 cnt[TILE_DIM][TILE_DIM];
+};
+
+struct hm_axis {
+	u32 lo;
+	u32 hi;
+	u32 aggr;
+	u32 log; /* cells per octave, 0 for linear */
+	double log_c;
+};
+
+struct hist2d {
+	struct hm_axis ax[2];
+	u32 n_cells[2];
+
+	struct hm_tile **slots;
+	u32 n_slots; /* power of 2 */
+	u32 n_tiles;
+	struct hm_tile *last;
+};
+
+static u32 axis_cell(const struct hm_axis *ax, u32 v)
+{
+	if (!ax->log)
+		return (v - ax->lo) / ax->aggr;
+
+	return ax->log * log2(1 + (v - ax->lo) / ax->log_c);
+}
+
+/* Lowest value which falls into @cell */
+static u32 axis_edge(const struct hm_axis *ax, u32 cell)
+{
+	double off;
+	u32 v;
+
+	if (!ax->log)
+		return ax->lo + cell * ax->aggr;
+
+	off = ceil(ax->log_c * (exp2((double)cell / ax->log) - 1));
+	v = ax->lo + (off < ax->hi - ax->lo ? off : ax->hi - ax->lo);
+	while (v < ax->hi && axis_cell(ax, v) < cell)
+		v++;
+	while (v > ax->lo && axis_cell(ax, v - 1) >= cell)
+		v--;
+
+	return v;
+}
+
+static void axis_init(struct hm_axis *ax, u32 lo, u32 hi, u32 aggr, u32 log)
+{
+	ax->lo = lo;
+	ax->hi = hi;
+	ax->aggr = aggr;
+	ax->log = log;
+	ax->log_c = log / M_LN2;
+}
+
+struct hist2d *hist2d_new(const void *ctx, const u32 lo[2], const u32 hi[2],
+			  u32 aggr, u32 log)
+{
+	struct hist2d *h;
+	int i;
+
+	h = tal_locked(talz(ctx, struct hist2d));
+	for (i = 0; i < 2; i++) {
+		axis_init(&h->ax[i], lo[i], hi[i], aggr, log);
+		h->n_cells[i] = axis_cell(&h->ax[i], hi[i]) + 1;
+	}
+
+	h->n_slots = 64;
+	h->slots = tal_locked(tal_arrz(h, struct hm_tile *, h->n_slots));
+
+	return h;
+}
+
+static inline u32 tile_hash(u32 tx, u32 ty)
+{
+	return (tx * 0x9e3779b1U) ^ (ty * 0x85ebca6bU);
+}
+
+static struct hm_tile *tile_find(const struct hist2d *h, u32 tx, u32 ty,
+				 u32 *slot)
+{
+	u32 i = tile_hash(tx, ty) & (h->n_slots - 1);
+
+	while (h->slots[i] && (h->slots[i]->tx != tx || h->slots[i]->ty != ty))
+		i = (i + 1) & (h->n_slots - 1);
+	if (slot)
+		*slot = i;
+
+	return h->slots[i];
+}
+
+static void tile_rehash(struct hist2d *h)
+{
+	struct hm_tile **old = h->slots;
+	u32 i, n_old = h->n_slots, slot;
+
+	h->n_slots *= 2;
+	h->slots = tal_locked(tal_arrz(h, struct hm_tile *, h->n_slots));
+	for (i = 0; i < n_old; i++)
+		if (old[i]) {
+			tile_find(h, old[i]->tx, old[i]->ty, &slot);
+			h->slots[slot] = old[i];
+		}
+	tal_locked(tal_free(old));
+}
+
+static struct hm_tile *tile_get(struct hist2d *h, u32 tx, u32 ty)
+{
+	struct hm_tile *tile;
+	u32 slot;
+
+	tile = tile_find(h, tx, ty, &slot);
+	if (tile)
+		return tile;
+
+	tile = tal_locked(talz(h, struct hm_tile));
+	tile->tx = tx;
+	tile->ty = ty;
+	h->slots[slot] = tile;
+
+	if (++h->n_tiles * 2 > h->n_slots)
+		tile_rehash(h);
+
+	return tile;
+}
+
+void hist2d_add(struct hist2d *h, u32 x, u32 y)
+{
+	const u32 cx = axis_cell(&h->ax[0], x), cy = axis_cell(&h->ax[1], y);
+	struct hm_tile *tile = h->last;
+
+	/* neighbouring samples mostly land in the same tile */
+	if (!tile || tile->tx != cx >> TILE_SHIFT ||
+	    tile->ty != cy >> TILE_SHIFT)
+		tile = h->last = tile_get(h, cx >> TILE_SHIFT,
+					  cy >> TILE_SHIFT);
+
+	tile->cnt[cx & TILE_MASK][cy & TILE_MASK]++;
+}
+
+/* Full matrix over the axes' range, absent tiles are zeros. */
+void hist2d_write_dense(const struct hist2d *h, struct wbuf *w)
+{
+	const struct hm_tile *tile;
+	u32 x, y;
+
+	wb_begin(w, "<u4", h->n_cells[1]);
+	for (x = 0; x < h->n_cells[0]; x++) {
+		tile = NULL;
+		for (y = 0; y < h->n_cells[1]; y++) {
+			if (!(y & TILE_MASK))
+				tile = tile_find(h, x >> TILE_SHIFT,
+						 y >> TILE_SHIFT, NULL);
+
+			wb_s32(w, tile ? tile->cnt[x & TILE_MASK]
+					  [y & TILE_MASK] : 0);
+			wb_char(w, ' ');
+		}
+		wb_eol(w);
+	}
+}
+
+static int tile_cmp(const void *a1, const void *a2)
+{
+	const struct hm_tile *a = *(const struct hm_tile **)a1;
+	const struct hm_tile *b = *(const struct hm_tile **)a2;
+
+	if (a->tx != b->tx)
+		return a->tx < b->tx ? -1 : 1;
+
+	return a->ty < b->ty ? -1 : a->ty > b->ty;
+}
+
+/* "t0 t1 count" of populated cells, t0 and t1 are the cells' lowest values,
+ * rows sorted by t0 then t1.
+ */
+void hist2d_write_sparse(const struct hist2d *h, struct wbuf *w)
+{
+	struct hm_tile **tiles;
+	u32 i, j, first, n = 0, r, c, x, y, *cnt;
+
+	tiles = malloc(h->n_tiles * sizeof(*tiles));
+	for (i = 0; i < h->n_slots; i++)
+		if (h->slots[i])
+			tiles[n++] = h->slots[i];
+	qsort(tiles, n, sizeof(*tiles), tile_cmp);
+
+	wb_begin(w, "<u4", 3);
+	for (first = 0; first < n; first = i) {
+		/* tiles [first, i) make up one band of TILE_DIM rows */
+		for (i = first; i < n && tiles[i]->tx == tiles[first]->tx; i++)
+			;
+
+		for (r = 0; r < TILE_DIM; r++) {
+			x = (tiles[first]->tx << TILE_SHIFT) + r;
+			for (j = first; j < i; j++) {
+				cnt = tiles[j]->cnt[r];
+				for (c = 0; c < TILE_DIM; c++) {
+					if (!cnt[c])
+						continue;
+
+					y = (tiles[j]->ty << TILE_SHIFT) + c;
+					wb_u32(w, axis_edge(&h->ax[0], x));
+					wb_char(w, ' ');
+					wb_u32(w, axis_edge(&h->ax[1], y));
+					wb_char(w, ' ');
+					wb_u32(w, cnt[c]);
+					wb_eol(w);
+				}
+			}
+		}
+	}
+
+	free(tiles);
+}
@@ -0,0 +1,161 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Frame offset index, <file>.idx next to the capture.  Every stride-th
+ * frame pair gets the offset parsing should restart from and the parser
+ * state at that point, so a sub-range is decoded by seeking to the entry
+ * before it.  The index is only valid for the capture it was built from
+ * (size and mtime) and for the --ifg, --skip-notif and DUT count it was
+ * built with, all change the state carried from one result to the next.
+ */
+
+#include "mgr_interp.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <ccan/tal/tal.h>
+#include <ccan/tal/str/str.h>
+
+static const char frame_index_magic[8] = "MGRIDX\0\2";
+
+/* Indexes live next to captures, directory scans have to skip them */
+bool is_index_file(const char *name)
+{
+	const size_t len = strlen(name);
+
+	return len > 4 && !strcmp(name + len - 4, ".idx");
+}
+
+struct frame_index *frame_index_new(u32 stride)
+{
+	struct frame_index *fi;
+
+	fi = tal_locked(talz(NULL, struct frame_index));
+	fi->hdr.stride = stride;
+	fi->ent = tal_locked(tal_arr(fi, struct frame_index_ent, 64));
+
+	return fi;
+}
+
+void frame_index_add(struct frame_index *fi, const struct frame_index_ent *e)
+{
+	if (fi->hdr.n_ent == tal_count(fi->ent))
+		tal_locked(tal_resize(&fi->ent, fi->hdr.n_ent * 2));
+	fi->ent[fi->hdr.n_ent++] = *e;
+}
+
+static bool frame_index_matches(const struct frame_index_hdr *hdr,
+				const struct stat *st)
+{
+	return !memcmp(hdr->magic, frame_index_magic, sizeof(hdr->magic)) &&
+		hdr->size == (u64)st->st_size &&
+		hdr->mtime == (s64)st->st_mtime &&
+		hdr->ifg == args.ifg && hdr->skip_notif == args.skip_notif &&
+		hdr->n_duts == args.n_duts;
+}
+
+int frame_index_save(struct frame_index *fi, const char *path)
+{
+	struct stat st;
+	char *idx_path;
+	FILE *f;
+	int ret = 0;
+
+	if (stat(path, &st))
+		return perr_ret("Could not stat result file");
+
+	memcpy(fi->hdr.magic, frame_index_magic, sizeof(fi->hdr.magic));
+	fi->hdr.size = st.st_size;
+	fi->hdr.mtime = st.st_mtime;
+	fi->hdr.ifg = args.ifg;
+	fi->hdr.skip_notif = args.skip_notif;
+	fi->hdr.n_duts = args.n_duts;
+
+	idx_path = tal_locked(tal_fmt(NULL, "%s.idx", path));
+	f = fopen(idx_path, "w");
+	tal_locked(tal_free(idx_path));
+	if (!f)
+		return perr_ret("Could not open index file");
+
+	if (fwrite(&fi->hdr, sizeof(fi->hdr), 1, f) != 1 ||
+	    (fi->hdr.n_ent &&
+	     fwrite(fi->ent, sizeof(*fi->ent), fi->hdr.n_ent, f) !=
+	     fi->hdr.n_ent))
+		ret = err_ret("Writing index failed\n");
+	if (fclose(f))
+		ret = perr_ret("Writing index failed");
+
+	return ret;
+}
+
+/* NULL if there is no index or it's stale, quietly, indexes are optional */
+struct frame_index *frame_index_load(const char *path)
+{
+	struct frame_index *fi;
+	struct stat st;
+	char *idx_path;
+	FILE *f;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	idx_path = tal_locked(tal_fmt(NULL, "%s.idx", path));
+	f = fopen(idx_path, "r");
+	tal_locked(tal_free(idx_path));
+	if (!f)
+		return NULL;
+
+	fi = tal_locked(talz(NULL, struct frame_index));
+	if (fread(&fi->hdr, sizeof(fi->hdr), 1, f) != 1 ||
+	    !frame_index_matches(&fi->hdr, &st))
+		goto err_free;
+
+	fi->ent = tal_locked(tal_arr(fi, struct frame_index_ent,
+				     fi->hdr.n_ent));
+	if (fi->hdr.n_ent &&
+	    fread(fi->ent, sizeof(*fi->ent), fi->hdr.n_ent, f) !=
+	    fi->hdr.n_ent)
+		goto err_free;
+
+	fclose(f);
+
+	return fi;
+
+err_free:
+	fclose(f);
+	tal_locked(tal_free(fi));
+	return NULL;
+}
+
+/* Last entry at or before both @pair and @clk, NULL if none is. */
+const struct frame_index_ent *
+frame_index_find(const struct frame_index *fi, u32 pair, u64 clk)
+{
+	u32 lo = 0, hi = fi->hdr.n_ent, mid;
+
+	/* both pair and elapsed grow with the entry # */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fi->ent[mid].pair <= pair && fi->ent[mid].elapsed <= clk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? &fi->ent[lo - 1] : NULL;
+}
@@ -23,206 +23,725 @@
 
 #include <dirent.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <ccan/opt/opt.h>
 #include <ccan/tal/tal.h>
+#include <ccan/tal/str/str.h>
 
 struct cmdline_args args = {
 	.res_dir = "./",
+	.plot_width = 2000,
+	.index_stride = 1024,
+	.cpd_thr = 10,
+	.n_duts = 2,
+	.dut_key = { 0x55, 0xaa },
+	.img_w = 1200,
+	.img_h = 1200,
+	.img_range = { 0, ~0U, 0, ~0U },
+#ifndef HAVE_LIBPNG
+	.img_format = IMG_PPM,
+#endif
+	.range = { .pair = { 0, ~0U }, .clk = { 0, ~0ULL } },
 };
 
+static char *opt_set_evt_family(const char *arg, enum evt_family *fam)
+{
+	int i;
+
+	for (i = 0; i <= EVT_ALL; i++)
+		if (!strcmp(arg, evt_family_names[i])) {
+			*fam = i;
+			return NULL;
+		}
+
+	return opt_invalid_argument(arg);
+}
+
+static char *opt_set_gof(const char *arg, enum gof_test *gof)
+{
+	int i;
+
+	for (i = 0; i < GOF_N_TESTS; i++)
+		if (!strcmp(arg, gof_names[i])) {
+			*gof = i;
+			return NULL;
+		}
+
+	return opt_invalid_argument(arg);
+}
+
+/* <clks> for all traces or one per trace in trace order, 0 for none */
+static char *opt_set_xceed(const char *arg, u32 *thr)
+{
+	const char *p = arg;
+	unsigned long v;
+	char *end;
+	u32 n = 0, i;
+
+	do {
+		if (n == MAX_TRACES)
+			return tal_fmt(NULL, "at most %d traces", MAX_TRACES);
+		errno = 0;
+		v = strtoul(p, &end, 0);
+		if (errno || end == p || v > ~0U)
+			return opt_invalid_argument(arg);
+		thr[n++] = v;
+		p = end + 1;
+	} while (*end == ',');
+
+	if (*end)
+		return opt_invalid_argument(arg);
+	for (i = n; i < MAX_TRACES; i++)
+		thr[i] = n == 1 ? thr[0] : 0;
+
+	return NULL;
+}
+
+/* Key bytes of the DUTs' result frames, in trace order */
+static char *opt_set_dut_keys(const char *arg, struct cmdline_args *a)
+{
+	const char *p = arg;
+	unsigned long k;
+	char *end;
+	u32 n = 0, i;
+
+	do {
+		if (n == MAX_DUTS)
+			return tal_fmt(NULL, "at most %d DUTs", MAX_DUTS);
+		errno = 0;
+		k = strtoul(p, &end, 0);
+		if (errno || end == p || k > 0xff)
+			return opt_invalid_argument(arg);
+		for (i = 0; i < n; i++)
+			if (a->dut_key[i] == k)
+				return opt_invalid_argument(arg);
+		a->dut_key[n++] = k;
+		p = end + 1;
+	} while (*end == ',');
+
+	if (*end || n < 2)
+		return opt_invalid_argument(arg);
+	a->n_duts = n;
+
+	return NULL;
+}
+
+/* <n> frame pairs or <n>us since the first result */
+static char *opt_set_range_(const char *arg, struct sub_range *r, int end)
+{
+	unsigned long long v;
+	char *unit;
+
+	errno = 0;
+	v = strtoull(arg, &unit, 0);
+	if (errno || unit == arg)
+		return opt_invalid_argument(arg);
+
+	if (!strcmp(unit, "us"))
+		r->clk[end] = us_to_clk(v);
+	else if (!*unit && v <= ~0U)
+		r->pair[end] = v;
+	else
+		return opt_invalid_argument(arg);
+
+	return NULL;
+}
+
+static char *opt_set_from(const char *arg, struct sub_range *r)
+{
+	return opt_set_range_(arg, r, 0);
+}
+
+static char *opt_set_to(const char *arg, struct sub_range *r)
+{
+	return opt_set_range_(arg, r, 1);
+}
+
+static char *opt_set_format(const char *arg, enum out_format *fmt)
+{
+	int i;
+
+	for (i = 0; i < FMT_N; i++)
+		if (!strcmp(arg, format_names[i])) {
+			*fmt = i;
+			return NULL;
+		}
+
+	return opt_invalid_argument(arg);
+}
+
+static char *opt_set_double(const char *arg, double *d)
+{
+	char *end;
+
+	errno = 0;
+	*d = strtod(arg, &end);
+	if (errno || end == arg || *end)
+		return opt_invalid_argument(arg);
+
+	return NULL;
+}
+
+static char *opt_set_img_format(const char *arg, enum img_format *fmt)
+{
+	int i;
+
+	for (i = 0; i < IMG_N; i++)
+		if (!strcmp(arg, img_format_names[i])) {
+#ifndef HAVE_LIBPNG
+			if (i == IMG_PNG)
+				return tal_fmt(NULL, "built without libpng, use ppm or pgm");
+#endif
+			*fmt = i;
+			return NULL;
+		}
+
+	return opt_invalid_argument(arg);
+}
+
+static char *opt_set_img_size(const char *arg, struct cmdline_args *a)
+{
+	char end;
+
+	if (sscanf(arg, "%ux%u%c", &a->img_w, &a->img_h, &end) != 2 ||
+	    !a->img_w || !a->img_h)
+		return opt_invalid_argument(arg);
+
+	return NULL;
+}
+
+/* <t0 from>:<t0 to>[,<t1 from>:<t1 to>], ends may be left empty */
+static char *opt_set_img_range(const char *arg, u32 *r)
+{
+	static const char sep[] = ":,:";
+	const char *p = arg;
+	char *end;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (i == 2 && !*p)
+			break;
+		if (i) {
+			if (*p != sep[i - 1])
+				return opt_invalid_argument(arg);
+			p++;
+		}
+		if (*p == sep[i])
+			continue;
+
+		errno = 0;
+		r[i] = strtoul(p, &end, 0);
+		if (errno || end == p)
+			return opt_invalid_argument(arg);
+		p = end;
+	}
+
+	return *p ? opt_invalid_argument(arg) : NULL;
+}
+
 static struct opt_table opts[] = {
 	OPT_WITH_ARG("-p|--pfx <prefix>", opt_set_charp, NULL,
 		     &args.res_pfx, "read files from result dir with names <prefix>*"),
 	OPT_WITH_ARG("-d|--res-dir <path>", opt_set_charp, NULL,
-		     &args.res_dir, "look for result files in <path>, default ./"),
+		     &args.res_dir, "look for result files in <path>, default ./, '-' or a FIFO to read a live capture"),
+	OPT_WITH_ARG("--cmp-pfx <prefix>", opt_set_charp, NULL,
+		     &args.cmp_pfx, "compare with files named <prefix>* (default: --pfx)"),
+	OPT_WITH_ARG("--cmp-dir <path>", opt_set_charp, NULL,
+		     &args.cmp_dir, "compare with result files in <path> (default: --res-dir)"),
 	OPT_WITH_ARG("-i|--ifg <clks>", opt_set_intval, NULL,
 		     &args.ifg, "expected inter frame gap"),
 	OPT_WITH_ARG("-s|--skip-notif <n>", opt_set_uintval, NULL,
 		     &args.skip_notif, "skip <n> results when notif seen"),
 	OPT_WITH_ARG("-b|--skip-begin <n>", opt_set_uintval, NULL,
 		     &args.skip_begin, "skip <n> at the beginning"),
+	OPT_WITH_ARG("--from <n>[us]", opt_set_from, NULL,
+		     &args.range, "analyse from frame pair <n> or <n>us into the capture"),
+	OPT_WITH_ARG("--to <n>[us]", opt_set_to, NULL,
+		     &args.range, "analyse up to frame pair <n> or <n>us into the capture"),
+	OPT_WITHOUT_ARG("--index", opt_set_bool,
+			&args.index, "write frame offset index <file>.idx for --from/--to and --preview"),
+	OPT_WITH_ARG("--index-stride <n>", opt_set_uintval, NULL,
+		     &args.index_stride, "frame pairs between index entries (default 1024)"),
+	OPT_WITH_ARG("--dut-keys <k>,<k>[,...]", opt_set_dut_keys, NULL,
+		     &args, "key bytes of the DUTs' frames, 2 to 8 DUTs (default 0x55,0xaa)"),
 	OPT_WITH_ARG("-R|--dump-raw <dir>", opt_set_charp, NULL,
 		     &args.raw, "dump raw data set to file"),
+	OPT_WITH_ARG("--events <dir>", opt_set_charp, NULL,
+		     &args.events, "dump index of notifs, skips, tx_ts fixups, IFG errors and --xceed samples"),
+	OPT_WITH_ARG("--xceed <clks>[,<clks>...]", opt_set_xceed, NULL,
+		     args.xceed, "index samples above threshold, one for all traces or one per trace"),
+	OPT_WITH_ARG("--jitter <dir>", opt_set_charp, NULL,
+		     &args.jitter, "analyse rx-to-rx and tx-to-tx gaps too, outputs go to <dir>/<output>"),
+	OPT_WITH_ARG("--plot <dir>", opt_set_charp, NULL,
+		     &args.plot, "dump traces downsampled to --plot-width columns"),
+	OPT_WITH_ARG("--plot-width <n>", opt_set_uintval, NULL,
+		     &args.plot_width, "# of columns for --plot (default 2000)"),
 	OPT_WITH_ARG("-D|--distribution <dir>", opt_set_charp, NULL,
 		     &args.distr, "dump distributions to given directory"),
 	OPT_WITH_ARG("-H|--heatmap <dir>", opt_set_charp, NULL,
 		     &args.hm, "dump heatmaps to given directory"),
 	OPT_WITH_ARG("-S|--stats <dir>", opt_set_charp, NULL,
 		     &args.stats, "write mean,stdev,correlation to given directory"),
+	OPT_WITH_ARG("--format <fmt>", opt_set_format, NULL,
+		     &args.format, "format of dumps: text (default), bin (little-endian) or npy"),
 	OPT_WITH_ARG("-n|--aggregate <n>", opt_set_intval, NULL,
 		     &args.aggr, "aggregation for simple statistics (bucket size)"),
+	OPT_WITH_ARG("--hm-log <n>", opt_set_uintval, NULL,
+		     &args.hm_log, "log scale heatmap axes with <n> cells per octave"),
+	OPT_WITHOUT_ARG("--hm-sparse", opt_set_bool,
+			&args.hm_sparse, "write heatmaps as 't0 t1 count' of populated cells"),
+	OPT_WITH_ARG("--hm-img <dir>", opt_set_charp, NULL,
+		     &args.hm_img, "render heatmap images to given directory"),
+	OPT_WITH_ARG("--img-size <w>x<h>", opt_set_img_size, NULL,
+		     &args, "size of --hm-img images in pixels (default 1200x1200)"),
+	OPT_WITH_ARG("--img-range <from>:<to>,<from>:<to>", opt_set_img_range, NULL,
+		     args.img_range, "t0 and t1 range of --hm-img images (default: all)"),
+	OPT_WITH_ARG("--img-format <fmt>", opt_set_img_format, NULL,
+		     &args.img_format, "--hm-img format: png (default if built with libpng), ppm or pgm"),
 	OPT_WITH_ARG("--stats-time-block <n>", opt_set_uintval, NULL,
 		     &args.svt_block, "block for stats/time"),
 	OPT_WITH_ARG("--stats-time-dir <dir>", opt_set_charp, NULL,
 		     &args.svt_dir, "output dir for stats/time"),
+	OPT_WITH_ARG("--changes <dir>", opt_set_charp, NULL,
+		     &args.changes, "split stats/time blocks into segments at change points, write per-segment stats"),
+	OPT_WITH_ARG("--cpd-threshold <x>", opt_set_double, NULL,
+		     &args.cpd_thr, "Page-Hinkley alarm threshold in stdevs (default 10)"),
+	OPT_WITH_ARG("--evt-family <name>", opt_set_evt_family, NULL,
+		     &args.evt_family, "EVT distribution to fit: gumbel (default), frechet, gev or all (best AIC)"),
+	OPT_WITH_ARG("--gof <test>", opt_set_gof, NULL,
+		     &args.gof, "goodness of fit test for EVT: ad (default), ks or chi2"),
+	OPT_WITHOUT_ARG("--pot", opt_set_bool,
+			&args.pot, "fit GPD to peaks over threshold as well"),
+	OPT_WITH_ARG("--bootstrap <n>", opt_set_uintval, NULL,
+		     &args.boot_reps, "bootstrap <n> replicates for EVT confidence intervals"),
 	OPT_WITHOUT_ARG("-r|--rebalance", opt_set_bool,
 			&args.rebalance, "rebalance results to make means match"),
+	OPT_WITH_ARG("-j|--jobs <n>", opt_set_uintval, NULL,
+		     &args.jobs, "number of worker threads (default: # of CPUs)"),
+	OPT_WITHOUT_ARG("--stream", opt_set_bool,
+			&args.stream, "write outputs and drop samples of each file once it's analysed"),
+	OPT_WITH_ARG("--mem-budget <MiB>", opt_set_uintval, NULL,
+		     &args.mem_budget, "limit samples of files in flight (implies --stream)"),
+	OPT_WITH_ARG("--scratch <dir>", opt_set_charp, NULL,
+		     &args.scratch, "keep samples in memory mapped files in <dir>"),
+	OPT_WITH_ARG("--manifest <file>", opt_set_charp, NULL,
+		     &args.manifest, "skip files analysed already according to <file>, record new ones"),
+	OPT_WITHOUT_ARG("--watch", opt_set_bool,
+			&args.watch, "keep analysing new result files as they are written (implies --stream)"),
+	OPT_WITH_ARG("--serve <socket>", opt_set_charp, NULL,
+		     &args.serve, "keep results in memory and answer queries on unix <socket>"),
+	OPT_WITHOUT_ARG("--global", opt_set_bool,
+			&args.global, "merge histograms and moments of all files and report on the whole campaign"),
+	OPT_WITH_ARG("--store <file>", opt_set_charp, NULL,
+		     &args.store, "append stats, EVT fits and percentiles to results store <file>"),
+	OPT_WITH_ARG("--campaign <name>", opt_set_charp, NULL,
+		     &args.campaign, "campaign to store results under (default: result dir)"),
+	OPT_WITH_ARG("--query <file>", opt_set_charp, NULL,
+		     &args.query, "query results store <file> and exit"),
+	OPT_WITH_ARG("--where <col><op><val>[,...]", opt_set_charp, NULL,
+		     &args.q_where, "rows to query, ops are < <= > >= = !="),
+	OPT_WITH_ARG("--select <col>[,...]", opt_set_charp, NULL,
+		     &args.q_select, "aggregate min, mean and max of columns instead of printing rows"),
+	OPT_WITH_ARG("--group-by <col>", opt_set_charp, NULL,
+		     &args.q_group, "aggregate per campaign, file or value of a column"),
+	OPT_WITH_ARG("--preview <k>", opt_set_uintval, NULL,
+		     &args.preview, "quick estimates from every <k>-th frame pair only"),
+	OPT_WITHOUT_ARG("--refine", opt_set_bool,
+			&args.refine, "keep halving --preview stride until all pairs are in"),
+	OPT_WITHOUT_ARG("--dry-run", opt_set_bool,
+			&args.dry_run, "print stages which would run and exit"),
 	OPT_WITHOUT_ARG("-q|--quiet", opt_set_bool,
 			&args.quiet, "suppress text output"),
 	OPT_ENDTABLE
 };
 
-typedef int (*delay2file_fn)(struct delay *d, FILE *f);
+typedef int (*delay2file_fn)(struct delay *d, struct wbuf *w);
 
-static int make_raw(struct delay *d, FILE *f)
+static int make_raw(struct delay *d, struct wbuf *w)
 {
-	u32 i;
+	u32 i, j;
 
-	for (i = 0; i < d->n_samples; i++)
-		fprintf(f, "%u %u\n", d->t[0].samples[i], d->t[1].samples[i]);
+	wb_begin(w, "<u4", args.n_duts);
+	for (i = 0; i < d->n_samples; i++) {
+		for (j = 0; j < args.n_duts; j++) {
+			if (j)
+				wb_char(w, ' ');
+			wb_u32(w, d->t[j].samples[i]);
+		}
+		wb_eol(w);
+	}
 
 	return 0;
 }
 
-static int make_distr(struct delay *d, FILE *f)
+static int make_events(struct delay *d, struct wbuf *w)
 {
-	u32 i;
-	u32 sums[3];
-	u32 val = d->t[2].min; /* t2 is min(t0,t1) so it has the global min */
-	u32 val_end = d->t[0].max > d->t[1].max ? d->t[0].max : d->t[1].max;
-	struct distribution *di[3], *di_end[3];
+	return write_events(d, w);
+}
 
-	for (i = 0; i < 3; i++) {
+static int make_plot(struct delay *d, struct wbuf *w)
+{
+	return write_downsampled(d, w, args.plot_width);
+}
+
+int write_distr(const struct delay *d, struct wbuf *w, u32 aggr,
+		u32 from, u32 to)
+{
+	u32 i, nt = d->n_traces;
+	u32 sums[MAX_TRACES], any;
+	u32 val = ~0U, val_end = 0;
+	const struct distribution *di[MAX_TRACES], *di_end[MAX_TRACES];
+
+	for (i = 0; i < nt; i++) {
+		if (d->t[i].min < val)
+			val = d->t[i].min;
+		if (d->t[i].max > val_end)
+			val_end = d->t[i].max;
+	}
+
+	if (val < from)
+		val = from;
+	if (val_end > to)
+		val_end = to;
+
+	for (i = 0; i < nt; i++) {
 		di[i] = d->t[i].distr;
 		di_end[i] = d->t[i].distr + tal_count(d->t[i].distr);
+		while (di[i] < di_end[i] && di[i]->val < val)
+			di[i]++;
 	}
 
+	wb_begin(w, "<u4", nt + 1);
 	while (val <= val_end) {
-		memset(sums, 0, sizeof(sums));
+		const u32 end = val_end - val < aggr ? val_end + 1 : val + aggr;
 
-		for (i = 0; i < 3; i++)
-			while (di[i] < di_end[i] &&
-			       di[i]->val < val + args.aggr)
-				sums[i] += (di[i]++)->cnt;
+		memset(sums, 0, sizeof(sums));
+		any = 0;
+
+		for (i = 0; i < nt; i++) {
+			if (d->t[i].pyr)
+				sums[i] = pyramid_sum(d->t[i].pyr, val, end);
+			else
+				while (di[i] < di_end[i] && di[i]->val < end)
+					sums[i] += (di[i]++)->cnt;
+			any |= sums[i];
+		}
 
-		if (sums[0] || sums[1] ||sums[2])
-			fprintf(f, "%d %u %u %u\n", val,
-				sums[0], sums[1], sums[2]);
+		if (any) {
+			wb_s32(w, val);
+			for (i = 0; i < nt; i++) {
+				wb_char(w, ' ');
+				wb_u32(w, sums[i]);
+			}
+			wb_eol(w);
+		}
 
-		val += args.aggr;
+		if (end > val_end)
+			break;
+		val += aggr;
 	}
 
 	return 0;
 }
 
-#define aggr(_t_) ((d->t[_t_].samples[i] - d->t[_t_].min) / args.aggr)
-static int make_hm(struct delay *d, FILE *f)
+static int make_distr(struct delay *d, struct wbuf *w)
 {
+	return write_distr(d, w, args.aggr, 0, ~0U);
+}
+
+#define in_win(_t_) (d->t[_t_].samples[i] >= lo[_t_] &&	\
+		     d->t[_t_].samples[i] <= hi[_t_])
+int write_hm(const struct delay *d, struct wbuf *w, u32 aggr,
+	     u32 x_from, u32 x_to, u32 y_from, u32 y_to)
+{
+	struct hist2d *h;
 	u32 i, j;
-	u32 **hm_table;
-	u32 dim[2];
+	u32 dim[2], lo[2], hi[2];
+	u32 x, x_end, y, y_end;
 
-	dim[0] = 1 + (d->t[0].max - d->t[0].min) / args.aggr;
-	dim[1] = 1 + (d->t[1].max - d->t[1].min) / args.aggr;
+	if (!d->n_samples)
+		return 0;
 
-	hm_table = calloc(dim[0], sizeof(*hm_table));
-	for (i = 0; i < dim[0]; i++)
-		hm_table[i] = calloc(dim[1], sizeof(**hm_table));
+	lo[0] = d->t[0].min > x_from ? d->t[0].min : x_from;
+	hi[0] = d->t[0].max < x_to ? d->t[0].max : x_to;
+	lo[1] = d->t[1].min > y_from ? d->t[1].min : y_from;
+	hi[1] = d->t[1].max < y_to ? d->t[1].max : y_to;
+	if (lo[0] > hi[0] || lo[1] > hi[1])
+		return 0;
 
-	for (i = 0; i < d->n_samples; i++)
-		hm_table[aggr(0)][aggr(1)]++;
+	if (d->pyr2 && !args.hm_log && !args.hm_sparse) {
+		dim[0] = 1 + (hi[0] - lo[0]) / aggr;
+		dim[1] = 1 + (hi[1] - lo[1]) / aggr;
+
+		wb_begin(w, "<u4", dim[1]);
+		for (i = 0; i < dim[0]; i++) {
+			x = lo[0] + i * aggr;
+			x_end = hi[0] - x < aggr ? hi[0] + 1 : x + aggr;
 
-	for (i = 0; i < dim[0]; i++) {
-		for (j = 0; j < dim[1]; j++)
-			fprintf(f, "%d ", hm_table[i][j]);
-		fputc('\n', f);
+			for (j = 0; j < dim[1]; j++) {
+				y = lo[1] + j * aggr;
+				y_end = hi[1] - y < aggr ? hi[1] + 1 : y + aggr;
+
+				wb_s32(w, pyramid2_sum(d->pyr2,
+						       x, x_end, y, y_end));
+				wb_char(w, ' ');
+			}
+			wb_eol(w);
+		}
+
+		return 0;
 	}
 
-	for (i = 0; i < dim[0]; i++)
-		free(hm_table[i]);
-	free(hm_table);
+	h = hist2d_new(NULL, lo, hi, aggr, args.hm_log);
+	for (i = 0; i < d->n_samples; i++)
+		if (in_win(0) && in_win(1))
+			hist2d_add(h, d->t[0].samples[i], d->t[1].samples[i]);
+
+	if (args.hm_sparse)
+		hist2d_write_sparse(h, w);
+	else
+		hist2d_write_dense(h, w);
+	tal_locked(tal_free(h));
 
 	return 0;
 }
+#undef in_win
 
-static int make_stats_vs_time(struct delay *d, FILE *f)
+static int make_hm(struct delay *d, struct wbuf *w)
+{
+	return write_hm(d, w, args.aggr, 0, ~0U, 0, ~0U);
+}
+
+static int make_changes(struct delay *d, struct wbuf *w)
+{
+	return write_changes(d, w);
+}
+
+/* Binary formats get all columns as doubles. */
+static int make_stats_vs_time(struct delay *d, struct wbuf *w)
 {
 	const u32 n_blocks = d->n_samples / args.svt_block;
+	const bool text = w->fmt == FMT_TEXT;
 	struct trace *t;
 	u32 i;
 
 	if (!d->t[0].svt_stats || !d->corr_vs_time)
 		return 0;
 
+	wb_begin(w, "<f8", d->n_traces * 4 + 1);
 	for (i = 0; i < n_blocks; i++) {
-		for_each_trace(d, t)
-			fprintf(f, "%u %u %le %le ",
-				t->svt_stats[i].min, t->svt_stats[i].max,
-				t->svt_stats[i].mean, t->svt_stats[i].stdev);
-		fprintf(f, "%le\n", d->corr_vs_time[i]);
+		for_each_trace(d, t) {
+			if (text) {
+				wb_u32(w, t->svt_stats[i].min);
+				wb_char(w, ' ');
+				wb_u32(w, t->svt_stats[i].max);
+			} else {
+				wb_dbl(w, t->svt_stats[i].min, 'e');
+				wb_dbl(w, t->svt_stats[i].max, 'e');
+			}
+			wb_char(w, ' ');
+			wb_dbl(w, t->svt_stats[i].mean, 'e');
+			wb_char(w, ' ');
+			wb_dbl(w, t->svt_stats[i].stdev, 'e');
+			wb_char(w, ' ');
+		}
+		wb_dbl(w, d->corr_vs_time[i], 'e');
+		wb_eol(w);
 	}
 
 	return 0;
 }
 
-static int make_stats(struct delay *d, FILE *f)
+/* Always text, it's a handful of mixed values. */
+static int make_stats(struct delay *d, struct wbuf *w)
 {
 	struct trace *t;
 
 	for_each_trace(d, t) {
-		fprintf(f, "%u %u %lf %lf",
-			t->min, t->max, t->mean, t->stdev);
+		wb_printf(w, "%u %u %lf %lf",
+			  t->min, t->max, t->mean, t->stdev);
 		if (t->ed.ok)
-			fprintf(f, "   %lf %lf %lf %u",
-				t->ed.a, t->ed.s, t->ed.m, t->ed.block_size);
-		fputc('\n', f);
+			wb_printf(w, "   %lf %lf %lf %u %s",
+				  t->ed.a, t->ed.s, t->ed.m, t->ed.block_size,
+				  evt_family_names[t->ed.family]);
+		wb_char(w, '\n');
 	}
 
 	for_each_trace(d, t)
-		fprintf(f, "%lf ", t->ed.xceed);
-	fputc('\n', f);
+		wb_printf(w, "%lf ", t->ed.xceed);
+	wb_char(w, '\n');
+
+	wb_printf(w, "%lf\n", d->corr);
 
-	fprintf(f, "%lf\n", d->corr);
+	if (args.pot)
+		for_each_trace(d, t)
+			wb_printf(w, "%lf %lf %lf %u %lf\n", t->pot.u,
+				  t->pot.sigma, t->pot.xi, t->pot.n_exc,
+				  t->pot.xceed);
+
+	if (args.boot_reps)
+		for_each_trace(d, t)
+			wb_printf(w, "%lf %lf %lf %lf %lf %lf %lf %lf\n",
+				  t->ed_ci.m[0], t->ed_ci.m[1],
+				  t->ed_ci.s[0], t->ed_ci.s[1],
+				  t->ed_ci.a[0], t->ed_ci.a[1],
+				  t->ed_ci.xceed[0], t->ed_ci.xceed[1]);
 
 	return 0;
 }
 
-#undef aggr
 #undef deggr
 
-static inline int make_delay_file(struct delay *d, delay2file_fn make_single)
+static const struct output {
+	const char *name;
+	char **dir;
+	delay2file_fn make_single;
+	u32 needs;
+	bool text_only;
+	bool jitter; /* mirrored to <jitter dir>/<name> */
+} outputs[] = {
+	{ "raw",	&args.raw,	make_raw,	STG(DECODE), false, true },
+	{ "events",	&args.events,	make_events,	STG(DECODE), false, false },
+	{ "plot",	&args.plot,	make_plot,	STG(DECODE), false, true },
+	{ "distr",	&args.distr,	make_distr,	STG(DISTR), false, true },
+	{ "heatmap",	&args.hm,	make_hm,	STG(DECODE), false, true },
+	{ "stats",	&args.stats,	make_stats,
+	  STG(MOMENTS) | STG(CORR) | STG(EVT), true, true },
+	{ "stats-time",	&args.svt_dir,	make_stats_vs_time, STG(SVT), false, true },
+	{ "changes",	&args.changes,	make_changes,	STG(CPD), false, true },
+};
+
+#define for_each_output(_o_)						\
+	for ((_o_) = outputs;						\
+	     (_o_) < outputs + sizeof(outputs)/sizeof(outputs[0]); (_o_)++) \
+		if (*(_o_)->dir)
+
+/* Stages needed for requested outputs and options, the plain text report
+ * if nothing else was asked for.
+ */
+static u32 plan_stages(void)
+{
+	const struct output *o;
+	u32 want = 0;
+
+	for_each_output(o)
+		want |= o->needs;
+	if (args.cmp_dir || args.cmp_pfx)
+		want |= STG(DISTR);
+	if (args.pot)
+		want |= STG(POT);
+	if (args.boot_reps)
+		want |= STG(BOOT);
+	if (args.serve)
+		want |= STG(MOMENTS) | STG(PYR) | STG(PYR2);
+	if (args.global)
+		want |= STG(MOMENTS) | STG(DISTR);
+	if (args.store)
+		want |= STG(MOMENTS) | STG(DISTR) | STG(CORR) | STG(EVT);
+	if (!want)
+		want = STG(MOMENTS) | STG(DISTR) | STG(CORR) | STG(EVT);
+	if (args.rebalance)
+		want |= STG(MOMENTS);
+	if (!args.svt_block)
+		want &= ~(STG(SVT) | STG(CPD));
+
+	return plan_closure(want);
+}
+
+static void print_plan(void)
+{
+	const struct output *o;
+
+	plan_print("Plan", args.stages);
+	for_each_output(o)
+		plan_print(o->name, plan_closure(o->needs) & args.stages);
+}
+
+static int make_delay_file(const char *dir, struct delay *d,
+			   delay2file_fn make_single, enum out_format fmt)
 {
+	struct wbuf w;
 	int ret;
+	char *path;
 	FILE *f;
 
-	f = fopen(d->fname, "w");
+	path = tal_fmt(NULL, "%s/%s%s%s", dir, d->fname,
+		       fmt == FMT_TEXT ? "" : ".", fmt == FMT_TEXT ? "" :
+		       format_names[fmt]);
+	f = fopen(path, "w");
+	tal_free(path);
 	if (!f)
 		return perr_ret("Opening distr file to write failed");
 
-	ret = make_single(d, f);
+	if (wb_open(&w, f, fmt)) {
+		fclose(f);
+		return 1;
+	}
+	ret = make_single(d, &w);
+	ret |= wb_close(&w);
 
 	fclose(f);
 
 	return ret;
 }
 
-static int make_per_delay(const char *dir, struct delay_bank *db,
-			  delay2file_fn make_single)
+static int make_output_dirs(void)
 {
-	int i, res;
-	char *cwd;
+	const struct output *o;
+	char *dir;
+	int res;
+
+	for_each_output(o) {
+		res = mkdir(*o->dir, 0777);
+		if (res && errno != EEXIST)
+			return perr_ret("Could not create distribution directory\n");
+	}
 
-	res = mkdir(dir, 0777);
-	if (res && errno != EEXIST)
-		return perr_ret("Could not create distribution directory\n");
+	if (args.hm_img) {
+		res = mkdir(args.hm_img, 0777);
+		if (res && errno != EEXIST)
+			return perr_ret("Could not create image directory\n");
+	}
 
-	cwd = get_current_dir_name();
-	if (!cwd)
-		return perr_ret("Could not get current dir");
-	if (chdir(dir))
-		return perr_ret("Could not go to the result dir");
+	if (args.jitter) {
+		res = mkdir(args.jitter, 0777);
+		if (res && errno != EEXIST)
+			return perr_ret("Could not create jitter directory\n");
+
+		for_each_output(o) {
+			if (!o->jitter)
+				continue;
+			dir = tal_fmt(NULL, "%s/%s", args.jitter, o->name);
+			res = mkdir(dir, 0777);
+			tal_free(dir);
+			if (res && errno != EEXIST)
+				return perr_ret("Could not create jitter directory\n");
+		}
+	}
 
-	for (i = 0; i < db->n; i++)
-		make_delay_file(db->bank[i], make_single);
+	return 0;
+}
 
-	chdir(cwd);
-	free(cwd);
+static void make_outputs(struct delay *d)
+{
+	const struct output *o;
+	char *dir;
 
-	return 0;
+	for_each_output(o) {
+		make_delay_file(*o->dir, d, o->make_single,
+				o->text_only ? FMT_TEXT : args.format);
+		if (!d->jit || !o->jitter)
+			continue;
+
+		dir = tal_fmt(NULL, "%s/%s", args.jitter, o->name);
+		make_delay_file(dir, d->jit, o->make_single,
+				o->text_only ? FMT_TEXT : args.format);
+		tal_free(dir);
+	}
 }
 
 static void maybe_rebalance(struct delay *d)
@@ -242,110 +761,464 @@ static void maybe_rebalance(struct delay *d)
 	    d->t[1].mean - d->t[0].mean);
 }
 
-static void calc_all_stats(struct delay *d)
+/* Every file is analysed by a small DAG of pool tasks:
+ *
+ *   parse -> stats(t0) --> corr
+ *         -> stats(t1) -/
+ *         -> stats(t2) ... stats(tN)
+ *   stats(tN) -> evt(tN)
+ *   parse -> img
+ *
+ * one stats per DUT plus the min (and max with more than 2 DUTs), with
+ * the min waiting for t0 and t1 when rebalancing.  Heatmap images
+ * are rendered by img, only t2 is ever rebalanced so it needs nothing
+ * but the parsed samples.  The joint t0 x t1 pyramid is built by corr,
+ * trace pyramids by stats.  Jitter traces get their own stats and corr
+ * but no EVT.  Each stage logs into its own buffer, buffers are printed
+ * in stage order once the whole file is done so output does not depend
+ * on scheduling.
+ */
+enum job_stage {
+	JOB_PARSE,
+	JOB_STATS0,
+	JOB_CORR = JOB_STATS0 + MAX_TRACES,
+	JOB_EVT0,
+	JOB_JIT_STATS0 = JOB_EVT0 + MAX_TRACES,
+	JOB_JIT_CORR = JOB_JIT_STATS0 + MAX_DUTS + 1,
+	JOB_IMG,
+	JOB_N_STAGES,
+};
+
+struct file_job {
+	char *path;
+	const char *name;
+	struct stat st;
+	u64 mem; /* expected size of sample columns */
+	bool render;
+	struct delay *d;
+	struct task_group grp;
+	struct task_log log[JOB_N_STAGES];
+};
+
+static void calc_trace(struct trace *t)
 {
-	struct trace *t;
-	int i;
+	struct delay *d = t->d;
 
-	for_each_trace_i(d, t, i) {
+	if (planned(DISTR) && !(t->stages_done_ & STG(DISTR)))
 		calc_distr(t);
+	if (planned(PYR))
+		calc_pyramid(t);
+
+	if (planned(MOMENTS) && !(t->stages_done_ & STG(MOMENTS))) {
 		calc_mean(t, d->n_samples);
 		calc_stdev(t, d->n_samples);
+	}
+
+	if (planned(SVT) && !(t->stages_done_ & STG(SVT))) {
+		t->svt_stats = tal_locked(tal_arr(d, struct stats_vs_time,
+						  d->n_samples / args.svt_block));
+
+		calc_svt_basic(t, d->n_samples);
+		calc_svt_stdev(t, d->n_samples);
+	}
+
+	if (planned(CPD))
+		calc_changes(t);
+}
+
+static void stats_task(void *arg)
+{
+	struct trace *t = arg;
+	struct delay *d = t->d;
 
+	if (args.rebalance && t == &d->t[args.n_duts])
+		maybe_rebalance(d);
+
+	calc_trace(t);
+
+	if (planned(MOMENTS))
 		msg("\tTrace %d: min %u max %u mean %lf stdev %lf\n",
-		    i, t->min, t->max, t->mean, t->stdev);
+		    (int)(t - d->t), t->min, t->max, t->mean, t->stdev);
+}
 
-		if (args.svt_block) {
-			t->svt_stats = tal_arr(d, struct stats_vs_time,
-					       d->n_samples / args.svt_block);
+static void jit_stats_task(void *arg)
+{
+	struct trace *t = arg;
+	int i = t - t->d->t;
 
-			calc_svt_basic(t, d->n_samples);
-			calc_svt_stdev(t, d->n_samples);
-		}
+	calc_trace(t);
 
-		if (args.rebalance && i == 1)
-			maybe_rebalance(d);
-	}
+	if (!planned(MOMENTS))
+		return;
+	if (i < (int)args.n_duts)
+		msg("\tJitter DUT%d rx: min %u max %u mean %lf stdev %lf\n",
+		    i + 1, t->min, t->max, t->mean, t->stdev);
+	else
+		msg("\tJitter tx: min %u max %u mean %lf stdev %lf\n",
+		    t->min, t->max, t->mean, t->stdev);
+}
 
-	if (args.svt_block && args.svt_dir)
+static void calc_joint(struct delay *d)
+{
+	if (planned(SVT) && !d->corr_vs_time)
 		calc_svt_corr(d);
 
-	calc_corr(d);
-	msg("\tCorrelation: %lf\n", d->corr);
+	if (planned(CORR) && !(d->stages_done_ & STG(CORR)))
+		calc_corr(d);
 
-	for_each_trace(d, t)
-		calc_gumbel(t, d->n_samples);
+	if (planned(PYR2))
+		calc_pyramid2(d);
 }
 
-static struct delay_bank *open_many(const char *dname, const char *pfx)
+static void corr_task(void *arg)
 {
-	DIR *dir;
-	struct dirent *ent;
-	int pfx_len = pfx ? strlen(pfx) : 0;
-	char *cwd;
-	struct delay_bank *db;
-	struct delay *d;
-	u32 full_distr = 0;
+	struct delay *d = arg;
 
-	cwd = get_current_dir_name();
-	if (!cwd)
-		return perr_nret("Could not get current dir");
-	if (chdir(dname))
-		return perr_nret("Could not go to the result dir");
+	calc_joint(d);
 
-	dir = opendir(".");
-	if (!dir)
-		return perr_nret("Could not open the result dir");
+	if (planned(CORR))
+		msg("\tCorrelation: %lf\n", d->corr);
+}
 
-	db = talz(NULL, struct delay_bank);
-	db->min_samples = -1;
+static void jit_corr_task(void *arg)
+{
+	struct delay *d = arg;
 
-	while ((ent = readdir(dir))) {
-		if (ent->d_type != DT_REG) {
-			msg("Skipping %s - not a regular file\n", ent->d_name);
-			continue;
+	calc_joint(d);
+
+	if (planned(CORR))
+		msg("\tJitter correlation: %lf\n", d->corr);
+}
+
+static void evt_task(void *arg)
+{
+	struct trace *t = arg;
+
+	if (planned(EVT))
+		calc_gumbel(t, t->d->n_samples);
+	if (planned(BOOT))
+		calc_bootstrap(t);
+	if (planned(POT))
+		calc_pot(t, t->d->n_samples);
+}
+
+static void img_task(void *arg)
+{
+	struct delay *d = arg;
+
+	render_hm(d, args.hm_img);
+}
+
+static void jit_tasks(struct file_job *job)
+{
+	struct delay *jit = job->d->jit;
+	struct task *stats[MAX_DUTS + 1], *corr;
+	u32 i;
+
+	for (i = 0; i < jit->n_traces; i++)
+		stats[i] = task_new(jit_stats_task, &jit->t[i], &job->grp,
+				    &job->log[JOB_JIT_STATS0 + i]);
+
+	if (planned(CORR) || planned(SVT) || planned(PYR2)) {
+		corr = task_new(jit_corr_task, jit, &job->grp,
+				&job->log[JOB_JIT_CORR]);
+		task_after(corr, stats[0]);
+		task_after(corr, stats[1]);
+		task_submit(corr);
+	}
+
+	for (i = 0; i < jit->n_traces; i++)
+		task_submit(stats[i]);
+}
+
+static void parse_task(void *arg)
+{
+	struct file_job *job = arg;
+	struct task *stats[MAX_TRACES], *corr, *evt;
+	u32 i, n_traces;
+
+	job->d = read_delay(job->path);
+	if (!job->d)
+		return;
+
+	if (job->render)
+		task_spawn(img_task, job->d, &job->grp, &job->log[JOB_IMG]);
+	if (job->d->jit)
+		jit_tasks(job);
+
+	n_traces = job->d->n_traces;
+	for (i = 0; i < n_traces; i++)
+		stats[i] = task_new(stats_task, &job->d->t[i], &job->grp,
+				    &job->log[JOB_STATS0 + i]);
+	if (args.rebalance) {
+		task_after(stats[args.n_duts], stats[0]);
+		task_after(stats[args.n_duts], stats[1]);
+	}
+
+	if (planned(CORR) || planned(SVT) || planned(PYR2)) {
+		corr = task_new(corr_task, job->d, &job->grp,
+				&job->log[JOB_CORR]);
+		task_after(corr, stats[0]);
+		task_after(corr, stats[1]);
+		task_submit(corr);
+	}
+
+	for (i = 0; i < n_traces && (planned(EVT) || planned(POT)); i++) {
+		evt = task_new(evt_task, &job->d->t[i], &job->grp,
+			       &job->log[JOB_EVT0 + i]);
+		task_after(evt, stats[i]);
+		task_submit(evt);
+	}
+
+	for (i = 0; i < n_traces; i++)
+		task_submit(stats[i]);
+}
+
+/* In streaming mode files are let in only while samples of the ones in
+ * flight fit in the memory budget (or one per worker without a budget).
+ */
+static bool job_may_start(const struct file_job *jobs, u32 first, u32 next)
+{
+	u64 mem = jobs[next].mem;
+	u32 i;
+
+	if (!args.stream || first == next)
+		return true;
+	if (!args.mem_budget)
+		return next - first < args.jobs;
+
+	for (i = first; i < next; i++)
+		mem += jobs[i].mem;
+
+	return mem <= (u64)args.mem_budget << 20;
+}
+
+static bool job_add(struct file_job **jobs, u32 *n_jobs, const char *dname,
+		    const char *name, const char *pfx, struct manifest *mf)
+{
+	struct file_job *job;
+
+	if ((pfx && strncmp(name, pfx, strlen(pfx))) || is_index_file(name) ||
+	    (mf && is_manifest_file(mf, name)))
+		return false;
+
+	tal_resize(jobs, *n_jobs + 1);
+	job = &(*jobs)[*n_jobs];
+	memset(job, 0, sizeof(*job));
+	job->path = tal_fmt(*jobs, "%s/%s", dname, name);
+	job->name = job->path + strlen(dname) + 1;
+	if (stat(job->path, &job->st)) {
+		perror("Could not stat result file");
+		tal_free(job->path);
+		return false;
+	}
+
+	if (mf && !S_ISFIFO(job->st.st_mode) &&
+	    manifest_fresh(mf, name, &job->st)) {
+		msg("Skipping %s - up to date\n", name);
+		tal_free(job->path);
+		return false;
+	}
+
+	/* Every sample is an 8B result per DUT on the wire and a u32 per
+	 * trace in memory, with up to 2x slack from doubling the columns.
+	 */
+	job->mem = job->st.st_size / args.n_duts * args.n_traces;
+	if (args.jitter)
+		job->mem *= 2;
+	(*n_jobs)++;
+
+	return true;
+}
+
+/* Returns # of files with all distributions fitted, -1 if any file failed. */
+static int run_jobs(struct delay_bank *db, struct file_job *jobs, u32 n_jobs,
+		    bool write_outputs, struct manifest *mf)
+{
+	struct trace *t;
+	u32 next = 0, i, j;
+	bool failed = false;
+	int full_distr = 0;
+
+	/* jobs array is not touched from now on, tasks can point into it */
+	for (i = 0; i < n_jobs; i++) {
+		struct delay *d;
+
+		for (; next < n_jobs && job_may_start(jobs, i, next); next++) {
+			jobs[next].render = write_outputs && args.hm_img;
+			task_spawn(parse_task, &jobs[next], &jobs[next].grp,
+				   &jobs[next].log[JOB_PARSE]);
 		}
-		if (pfx && strncmp(ent->d_name, pfx, pfx_len))
-			continue;
 
-		if (db->bank)
-			tal_resize(&db->bank, ++db->n);
-		else
-			db->bank = tal_arr(db, struct delay *, ++db->n);
+		pool_wait(&jobs[i].grp);
+		for (j = 0; j < JOB_N_STAGES; j++)
+			task_log_flush(&jobs[i].log[j]);
 
-		d = read_delay(ent->d_name);
-		if (!d) {
-			tal_free(db);
-			db = NULL;
-			goto out;
+		d = jobs[i].d;
+		if (!d || failed) {
+			failed = true;
+			tal_locked(tal_free(d));
+			continue;
 		}
 
 		if (db->min_samples > d->n_samples)
 			db->min_samples = d->n_samples;
 
-		calc_all_stats(d);
+		for_each_trace(d, t)
+			d->distrs_failed |= !planned(EVT) || !t->ed.ok;
 		if (!d->distrs_failed)
 			full_distr++;
 
+		if (args.stream) {
+			if (write_outputs)
+				make_outputs(d);
+			delay_release_samples(d);
+		}
+		if (mf && S_ISREG(jobs[i].st.st_mode))
+			manifest_update(mf, jobs[i].name, &jobs[i].st, d);
+
+		pthread_mutex_lock(&tal_lock);
+		if (db->bank)
+			tal_resize(&db->bank, ++db->n);
+		else
+			db->bank = tal_arr(db, struct delay *, ++db->n);
 		tal_steal(db->bank, d);
+		pthread_mutex_unlock(&tal_lock);
 		db->bank[db->n - 1] = d;
 	}
 
+	return failed ? -1 : full_distr;
+}
+
+static struct delay_bank *open_many(const char *dname, const char *pfx,
+				    bool write_outputs, struct manifest *mf)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct delay_bank *db;
+	struct file_job *jobs;
+	struct stat st;
+	u32 n_jobs = 0;
+	int full_distr;
+
+	db = talz(NULL, struct delay_bank);
+	db->min_samples = -1;
+	jobs = tal_arr(db, struct file_job, 0);
+
+	/* A live capture given directly instead of a result dir */
+	if (!strcmp(dname, "-") ||
+	    (!stat(dname, &st) && S_ISFIFO(st.st_mode))) {
+		tal_resize(&jobs, ++n_jobs);
+		memset(jobs, 0, sizeof(*jobs));
+		jobs->path = tal_strdup(jobs, dname);
+		jobs->name = jobs->path;
+		goto run;
+	}
+
+	dir = opendir(dname);
+	if (!dir) {
+		tal_free(db);
+		return perr_nret("Could not open the result dir");
+	}
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_type != DT_REG && ent->d_type != DT_FIFO) {
+			msg("Skipping %s - not a regular file\n", ent->d_name);
+			continue;
+		}
+
+		job_add(&jobs, &n_jobs, dname, ent->d_name, pfx, mf);
+	}
+	closedir(dir);
+
+run:
+	full_distr = run_jobs(db, jobs, n_jobs, write_outputs, mf);
+	if (full_distr < 0) {
+		tal_free(db);
+		return NULL;
+	}
+
+	tal_free(jobs);
+
 	msg("Read %d files [at least %u samples][%u full distrs]\n",
 	    db->n, db->min_samples, full_distr);
+	if (mf)
+		manifest_report(mf);
+
+	return db;
+}
+
+static int preview_many(const char *dname, const char *pfx)
+{
+	struct dirent *ent;
+	char *path;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir(dname);
+	if (!dir)
+		return perr_ret("Could not open the result dir");
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_type != DT_REG ||
+		    (pfx && strncmp(ent->d_name, pfx, strlen(pfx))) ||
+		    is_index_file(ent->d_name))
+			continue;
 
-out:
+		path = tal_fmt(NULL, "%s/%s", dname, ent->d_name);
+		ret |= preview_file(path, args.preview, args.refine);
+		tal_free(path);
+	}
 	closedir(dir);
 
-	chdir(cwd);
-	free(cwd);
+	return ret;
+}
 
-	return db;
+/* Analyse result files as soon as they are closed after writing. */
+static int watch_dir(int fd, struct delay_bank *db, struct manifest *mf)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct file_job *jobs;
+	u32 n_jobs;
+	ssize_t len;
+	char *p;
+
+	msg("Watching %s for new results\n", args.res_dir);
+	fflush(stdout);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (void *)p;
+			if (!ev->len)
+				continue;
+
+			n_jobs = 0;
+			jobs = tal_arr(db, struct file_job, 0);
+			if (!job_add(&jobs, &n_jobs, args.res_dir, ev->name,
+				     args.res_pfx, mf)) {
+				tal_free(jobs);
+				continue;
+			}
+			if (run_jobs(db, jobs, n_jobs, true, mf) < 0)
+				err("Failed to analyse %s\n", ev->name);
+			tal_free(jobs);
+
+			/* only after a job, saving fires events of its own */
+			if (mf)
+				manifest_save(mf);
+			fflush(stdout);
+		}
+	}
+
+	return perr_ret("Reading inotify events failed");
 }
 
 int main(int argc, char **argv)
 {
 	struct delay_bank *db;
+	struct manifest *mf = NULL;
+	int i, watch_fd = -1;
 
 	opt_register_table(opts, NULL);
 
@@ -354,26 +1227,106 @@ int main(int argc, char **argv)
 
 	opt_free_table();
 
+	if (args.query)
+		return store_query(args.query, args.q_where, args.q_select,
+				   args.q_group);
+
 	if (!args.ifg)
 		err("Consider setting ifg to improve parsing accuracy\n");
 
-	db = open_many(args.res_dir, args.res_pfx);
-	if (!db)
+	args.n_traces = args.n_duts > 2 ? args.n_duts + 2 : 3;
+	if (args.rebalance && args.n_duts != 2)
+		return err_ret("--rebalance only works with 2 DUTs\n");
+
+	args.stages = plan_stages();
+	if (args.dry_run) {
+		print_plan();
+		return 0;
+	}
+
+	if (args.preview)
+		return preview_many(args.res_dir, args.res_pfx);
+
+	if (make_output_dirs())
+		return 1;
+
+	if (args.mem_budget || args.watch)
+		args.stream = true;
+	if (args.serve && args.stream)
+		return err_ret("Queries need samples, --serve can't be used with --stream\n");
+	if (args.changes && !args.svt_block)
+		return err_ret("--changes works on stats/time blocks, set --stats-time-block\n");
+	if (!args.jobs)
+		args.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pool_init(args.jobs))
+		return 1;
+
+	/* Skipped files wouldn't be in the bank, don't pass off a part of
+	 * it as the whole campaign.
+	 */
+	if (args.manifest && (args.cmp_dir || args.cmp_pfx || args.global ||
+			      args.serve || args.store))
+		err("--manifest ignored, all files are needed for --global, --serve, --store and comparisons\n");
+	else if (args.manifest)
+		mf = manifest_load(args.manifest);
+
+	/* Watch before the first scan so no file slips in between. */
+	if (args.watch) {
+		watch_fd = inotify_init1(IN_CLOEXEC);
+		if (watch_fd < 0 ||
+		    inotify_add_watch(watch_fd, args.res_dir,
+				      IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+			return perr_ret("Could not watch the result dir");
+	}
+
+	db = open_many(args.res_dir, args.res_pfx, true, mf);
+	if (mf)
+		manifest_save(mf);
+	if (!db) {
+		pool_fini();
 		return 1;
+	}
+
+	if (!args.stream)
+		for (i = 0; i < db->n; i++)
+			make_outputs(db->bank[i]);
+	if (args.store)
+		store_append(args.store, args.campaign ?: args.res_dir, db);
+
+	if (args.global) {
+		struct delay *g = merge_bank(db);
+
+		if (g) {
+			calc_global(g, db->n);
+			if (args.distr)
+				make_delay_file(args.distr, g, make_distr,
+						args.format);
+			if (args.stats)
+				make_delay_file(args.stats, g, make_stats,
+						FMT_TEXT);
+		}
+		tal_free(g);
+	}
+
+	if (args.cmp_dir || args.cmp_pfx) {
+		struct delay_bank *db_b;
+
+		db_b = open_many(args.cmp_dir ?: args.res_dir,
+				 args.cmp_pfx ?: args.res_pfx, false, NULL);
+		if (db_b)
+			compare_banks(db, db_b);
+		tal_free(db_b);
+	}
 
-	if (args.raw)
-		make_per_delay(args.raw, db, make_raw);
-	if (args.distr)
-		make_per_delay(args.distr, db, make_distr);
-	if (args.hm)
-		make_per_delay(args.hm, db, make_hm);
-	if (args.stats)
-		make_per_delay(args.stats, db, make_stats);
-	if (args.svt_dir)
-		make_per_delay(args.svt_dir, db, make_stats_vs_time);
+	if (args.watch)
+		watch_dir(watch_fd, db, mf);
+	if (args.serve)
+		serve(db, args.serve);
 
+	tal_free(mf);
 	tal_free(db);
 
+	pool_fini();
 	tal_cleanup();
 
 	return 0;
@@ -0,0 +1,251 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Results manifest.  One line per analysed file with its size, mtime and a
+ * hash of the options which affect the results, followed by the summary
+ * of the results.  Files whose fingerprint matches are not analysed again,
+ * so they are not in the bank either, runs which need every file's data
+ * (--global, --serve, --store, comparisons) don't use the manifest.
+ */
+
+#include "mgr_interp.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <ccan/tal/tal.h>
+#include <ccan/tal/str/str.h>
+
+#define MANIFEST_HDR	"# mgr_interp manifest v1"
+
+struct manifest_ent {
+	char *name;
+	u64 size;
+	u64 mtime; /* ns */
+	u64 opts;
+	char *summary;
+};
+
+struct manifest {
+	char *path;
+	u64 opts;
+
+	u32 n;
+	struct manifest_ent *ents;
+
+	u32 n_fresh; /* files skipped as up to date */
+	u32 n_fresh_fitted; /* ... which had all distributions fitted */
+};
+
+static inline u64 st_mtime_ns(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* FNV-1a of everything which changes the contents of results. */
+static u64 manifest_opts_hash(void)
+{
+	u64 h = 0xcbf29ce484222325ULL;
+	char *s, *p;
+	u32 i;
+
+	s = tal_fmt(NULL, "%d %u %u %d %u %d %d %d %u %d %u %s %s %s %s %s %s %lf",
+		    args.ifg, args.skip_notif, args.skip_begin,
+		    args.rebalance, args.svt_block, args.evt_family,
+		    args.gof, args.pot, args.boot_reps, args.aggr, args.stages,
+		    args.raw ?: "-", args.distr ?: "-", args.hm ?: "-",
+		    args.stats ?: "-", args.svt_dir ?: "-",
+		    args.changes ?: "-", args.cpd_thr);
+	tal_append_fmt(&s, " %d %u %d %s %u %s %s %s %u %u %d",
+		       args.format, args.hm_log, args.hm_sparse,
+		       args.plot ?: "-", args.plot_width, args.events ?: "-",
+		       args.jitter ?: "-", args.hm_img ?: "-",
+		       args.img_w, args.img_h, args.img_format);
+	for (i = 0; i < sizeof(args.img_range)/sizeof(args.img_range[0]); i++)
+		tal_append_fmt(&s, " %u", args.img_range[i]);
+	for (i = 0; i < sizeof(args.xceed)/sizeof(args.xceed[0]); i++)
+		tal_append_fmt(&s, " %u", args.xceed[i]);
+	tal_append_fmt(&s, " %u %u %" PRIu64 " %" PRIu64,
+		       args.range.pair[0], args.range.pair[1],
+		       args.range.clk[0], args.range.clk[1]);
+	for (i = 0; i < args.n_duts; i++)
+		tal_append_fmt(&s, " %02x", args.dut_key[i]);
+	for (p = s; *p; p++)
+		h = (h ^ (u8)*p) * 0x100000001b3ULL;
+	tal_free(s);
+
+	return h;
+}
+
+static struct manifest_ent *manifest_find(struct manifest *m,
+					  const char *name)
+{
+	u32 i;
+
+	for (i = 0; i < m->n; i++)
+		if (!strcmp(m->ents[i].name, name))
+			return &m->ents[i];
+
+	return NULL;
+}
+
+static struct manifest_ent *manifest_add(struct manifest *m, const char *name)
+{
+	struct manifest_ent *ent;
+
+	tal_resize(&m->ents, m->n + 1);
+	ent = &m->ents[m->n++];
+	memset(ent, 0, sizeof(*ent));
+	ent->name = tal_strdup(m->ents, name);
+
+	return ent;
+}
+
+struct manifest *manifest_load(const char *path)
+{
+	struct manifest_ent *ent;
+	struct manifest *m;
+	char *line = NULL, *name;
+	size_t len = 0;
+	u64 size, mtime, opts;
+	int off;
+	FILE *f;
+
+	m = talz(NULL, struct manifest);
+	m->path = tal_strdup(m, path);
+	m->opts = manifest_opts_hash();
+	m->ents = tal_arr(m, struct manifest_ent, 0);
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			perror("Could not open manifest");
+		return m;
+	}
+
+	while (getline(&line, &len, f) > 0) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%ms %" SCNu64 " %" SCNu64 " %" SCNx64 " %n",
+			   &name, &size, &mtime, &opts, &off) < 4)
+			continue;
+
+		line[strcspn(line, "\n")] = 0;
+
+		ent = manifest_find(m, name) ?: manifest_add(m, name);
+		ent->size = size;
+		ent->mtime = mtime;
+		ent->opts = opts;
+		tal_free(ent->summary);
+		ent->summary = tal_strdup(m->ents, line + off);
+		free(name);
+	}
+	free(line);
+	fclose(f);
+
+	return m;
+}
+
+/* Returns summary of the previous run if @name didn't change since. */
+const char *manifest_fresh(struct manifest *m, const char *name,
+			   const struct stat *st)
+{
+	struct manifest_ent *ent = manifest_find(m, name);
+	int failed = 1;
+
+	if (!ent || ent->opts != m->opts || ent->size != (u64)st->st_size ||
+	    ent->mtime != st_mtime_ns(st))
+		return NULL;
+
+	m->n_fresh++;
+	sscanf(ent->summary, "%*u %*u %*u %d", &failed);
+	m->n_fresh_fitted += !failed;
+
+	return ent->summary;
+}
+
+/* The manifest itself and its temporary copy may live among the results */
+bool is_manifest_file(const struct manifest *m, const char *name)
+{
+	const char *base = strrchr(m->path, '/') ? strrchr(m->path, '/') + 1 :
+		m->path;
+	const size_t len = strlen(base);
+
+	return !strncmp(name, base, len) &&
+		(!name[len] || !strcmp(name + len, ".tmp"));
+}
+
+void manifest_report(const struct manifest *m)
+{
+	if (m->n_fresh)
+		msg("Skipped %u files - up to date [%u full distrs]\n",
+		    m->n_fresh, m->n_fresh_fitted);
+}
+
+void manifest_update(struct manifest *m, const char *name,
+		     const struct stat *st, const struct delay *d)
+{
+	struct manifest_ent *ent;
+	const struct trace *t;
+	char *s;
+
+	pthread_mutex_lock(&tal_lock);
+
+	ent = manifest_find(m, name) ?: manifest_add(m, name);
+	ent->size = st->st_size;
+	ent->mtime = st_mtime_ns(st);
+	ent->opts = m->opts;
+
+	s = tal_fmt(m->ents, "%u %u %u %d %lf", d->n_samples,
+		    d->n_real_samples, d->n_notifs, d->distrs_failed, d->corr);
+	for_each_trace(d, t)
+		tal_append_fmt(&s, "  %u %u %lf %lf %d %lf %lf %lf %u %lf",
+			       t->min, t->max, t->mean, t->stdev, t->ed.ok,
+			       t->ed.a, t->ed.s, t->ed.m, t->ed.block_size,
+			       t->ed.xceed);
+	tal_free(ent->summary);
+	ent->summary = s;
+
+	pthread_mutex_unlock(&tal_lock);
+}
+
+int manifest_save(struct manifest *m)
+{
+	char *tmp;
+	FILE *f;
+	u32 i;
+
+	tmp = tal_locked(tal_fmt(NULL, "%s.tmp", m->path));
+	f = fopen(tmp, "w");
+	if (!f) {
+		tal_locked(tal_free(tmp));
+		return perr_ret("Could not write manifest");
+	}
+
+	fprintf(f, MANIFEST_HDR "\n");
+	for (i = 0; i < m->n; i++)
+		fprintf(f, "%s %" PRIu64 " %" PRIu64 " %" PRIx64 " %s\n",
+			m->ents[i].name, m->ents[i].size, m->ents[i].mtime,
+			m->ents[i].opts, m->ents[i].summary);
+	fclose(f);
+
+	if (rename(tmp, m->path))
+		perror("Could not replace manifest");
+	tal_locked(tal_free(tmp));
+
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Campaign aggregate.  Histograms and moments of all files in the bank are
+ * merged pairwise, level by level, with the merges of each level running
+ * on the pool.  Histogram counts and sums merge exactly, centred sums of
+ * squares and the t0/t1 co-moment with the pairwise update of Chan et al.
+ * The result is a delay without samples which is fitted like any other,
+ * see calc_gumbel() for how EVT copes without samples.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+#include <ccan/tal/str/str.h>
+
+struct merge_step {
+	struct delay *dst;
+	const struct delay *a;
+	const struct delay *b;
+};
+
+static struct distribution *distr_merge(struct delay *ctx,
+					const struct distribution *a,
+					const struct distribution *b)
+{
+	const u32 na = tal_count(a), nb = tal_count(b);
+	struct distribution *m;
+	u32 i = 0, j = 0, n = 0;
+
+	m = tal_locked(tal_arr(ctx, struct distribution, na + nb));
+
+	while (i < na || j < nb) {
+		if (j == nb || (i < na && a[i].val < b[j].val)) {
+			m[n++] = a[i++];
+		} else if (i == na || b[j].val < a[i].val) {
+			m[n++] = b[j++];
+		} else {
+			m[n].val = a[i].val;
+			m[n++].cnt = a[i++].cnt + b[j++].cnt;
+		}
+	}
+	tal_locked(tal_resize(&m, n));
+
+	return m;
+}
+
+static void trace_merge(struct trace *t, const struct trace *a, u32 na,
+			const struct trace *b, u32 nb)
+{
+	const u32 n = na + nb;
+	const double delta = b->mean - a->mean;
+
+	t->min = a->min < b->min ? a->min : b->min;
+	t->max = a->max > b->max ? a->max : b->max;
+	t->distr = distr_merge(t->d, a->distr, b->distr);
+
+	if (!na || !nb) {
+		const struct trace *src = na ? a : b;
+
+		t->sum = src->sum;
+		t->mean = src->mean;
+		t->stdev_sum = src->stdev_sum;
+		t->stdev = src->stdev;
+		return;
+	}
+
+	t->sum = a->sum + b->sum;
+	t->mean = (double)t->sum / n;
+	t->stdev_sum = a->stdev_sum + b->stdev_sum +
+		delta * delta * na / n * nb;
+	t->stdev = sqrt(t->stdev_sum / (n - 1));
+}
+
+/* Sum of products of t0 and t1 deviations, recovered from the correlation */
+static double co_moment(const struct delay *d)
+{
+	if (!planned(CORR) || !d->n_samples)
+		return 0;
+
+	return d->corr * sqrt(d->t[0].stdev_sum) * sqrt(d->t[1].stdev_sum);
+}
+
+static void merge_task(void *arg)
+{
+	struct merge_step *s = arg;
+	const struct delay *a = s->a, *b = s->b;
+	struct delay *d = s->dst;
+	u32 i;
+
+	d->n_samples = a->n_samples + b->n_samples;
+	d->n_real_samples = a->n_real_samples + b->n_real_samples;
+	d->n_notifs = a->n_notifs + b->n_notifs;
+
+	d->n_traces = a->n_traces;
+	for (i = 0; i < d->n_traces; i++) {
+		d->t[i].d = d;
+		trace_merge(&d->t[i], &a->t[i], a->n_samples,
+			    &b->t[i], b->n_samples);
+	}
+
+	if (planned(CORR) && d->n_samples)
+		d->corr = (co_moment(a) + co_moment(b) +
+			   (b->t[0].mean - a->t[0].mean) *
+			   (b->t[1].mean - a->t[1].mean) *
+			   a->n_samples / d->n_samples * b->n_samples) /
+			(sqrt(d->t[0].stdev_sum) * sqrt(d->t[1].stdev_sum));
+}
+
+/* Tree reduction of the whole bank, returns a delay with merged stats. */
+struct delay *merge_bank(const struct delay_bank *db)
+{
+	const struct delay **lvl, **next;
+	struct merge_step *steps;
+	struct task_group grp = {};
+	struct delay *g;
+	u32 n = db->n, i;
+	u64 total = 0;
+	void *ctx;
+
+	if (!n)
+		return NULL;
+
+	/* counts and histograms are u32, as for a single file */
+	for (i = 0; i < n; i++)
+		total += db->bank[i]->n_real_samples;
+	if (total > ~0U) {
+		err("Campaign has %" PRIu64 " samples, too many for --global\n",
+		    total);
+		return NULL;
+	}
+
+	/* intermediate levels hang off ctx, the root is stolen at the end */
+	ctx = tal(NULL, char);
+	lvl = tal_arr(ctx, const struct delay *, n);
+	memcpy(lvl, db->bank, n * sizeof(*lvl));
+	steps = tal_arr(ctx, struct merge_step, n / 2);
+	next = tal_arr(ctx, const struct delay *, n);
+
+	while (n > 1) {
+		/* allocate before spawning, running merges use tal too */
+		for (i = 0; i < n / 2; i++) {
+			steps[i].dst = talz(ctx, struct delay);
+			steps[i].a = lvl[2 * i];
+			steps[i].b = lvl[2 * i + 1];
+			next[i] = steps[i].dst;
+		}
+		for (i = 0; i < n / 2; i++)
+			task_spawn(merge_task, &steps[i], &grp, NULL);
+		if (n % 2)
+			next[i++] = lvl[n - 1];
+		pool_wait(&grp);
+
+		memcpy(lvl, next, i * sizeof(*lvl));
+		n = i;
+	}
+
+	if (db->n == 1) {
+		/* merge with nothing to get a private copy */
+		struct delay *empty = talz(ctx, struct delay);
+
+		empty->n_traces = lvl[0]->n_traces;
+		for (i = 0; i < empty->n_traces; i++)
+			empty->t[i].min = -1;
+
+		steps = tal_arr(ctx, struct merge_step, 1);
+		steps->dst = talz(ctx, struct delay);
+		steps->a = lvl[0];
+		steps->b = empty;
+		merge_task(steps);
+		lvl[0] = steps->dst;
+	}
+
+	g = tal_steal(NULL, (struct delay *)lvl[0]);
+	g->fname = tal_strdup(g, "global");
+	tal_free(ctx);
+
+	return g;
+}
+
+static u32 distr_pct(const struct trace *t, double p)
+{
+	u64 acc = 0;
+	u32 i;
+
+	for (i = 0; i < tal_count(t->distr); i++) {
+		acc += t->distr[i].cnt;
+		if (acc >= p / 100 * t->d->n_samples)
+			return t->distr[i].val;
+	}
+
+	return t->max;
+}
+
+/* Fit the merged data and print the campaign report. */
+void calc_global(struct delay *g, u32 n_files)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+	struct trace *t;
+	u32 i;
+
+	msg("Global [%u files][%u samples]\n", n_files, g->n_samples);
+
+	for_each_trace(g, t) {
+		msg("\tTrace %d: min %u max %u mean %lf stdev %lf\n",
+		    (int)(t - g->t), t->min, t->max, t->mean, t->stdev);
+		msg("\t\tpercentiles:");
+		for (i = 0; i < sizeof(pcts)/sizeof(pcts[0]); i++)
+			msg(" p%lg %u", pcts[i], distr_pct(t, pcts[i]));
+		msg("\n");
+
+		if (planned(EVT))
+			calc_gumbel(t, g->n_samples);
+		if (planned(BOOT))
+			calc_bootstrap(t);
+		if (planned(POT))
+			calc_pot(t, g->n_samples);
+		g->distrs_failed |= !planned(EVT) || !t->ed.ok;
+	}
+
+	if (planned(CORR))
+		msg("\tCorrelation: %lf\n", g->corr);
+}
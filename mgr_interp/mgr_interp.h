@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <ccan/short_types/short_types.h>
 
@@ -35,38 +36,181 @@
 #define FYLW  "\e[33m"
 
 #define dbg(fmt...)  if (0) printf(fmt)
-#define msg(fmt...)  ({ if (!args.quiet) printf(fmt); })
-#define err(fmt...)  ({ fprintf(stderr, FRED fmt); fprintf(stderr, FNORM); })
+/* Tasks running in the pool log into per-task buffers, see task_run() */
+extern __thread FILE *log_out, *log_err;
+
+#define msg(fmt...)  ({ if (!args.quiet) fprintf(log_out ?: stdout, fmt); })
+#define err(fmt...)  ({ fprintf(log_err ?: stderr, FRED fmt);		\
+			fprintf(log_err ?: stderr, FNORM); })
 #define err_ret(fmt...) ({ err(fmt); 1; })
 #define err_nret(fmt...) ({ err(fmt); NULL; })
 #define perr_ret(msg) ({ perror(msg); 1; })
 #define perr_nret(msg) ({ perror(msg); NULL; })
 
 #define PCAP_CNT_INF		-1
+#define FRAME_N_RES		128 /* results in a frame */
+#define MAX_DUTS		8
+#define MAX_TRACES		(MAX_DUTS + 2) /* DUTs, min and max */
 #define PCAP_SNAPLEN_ALL	2048
 
 #define us_to_clk(x) ((x)*1000/8)
 #define clk_to_us(x) ((x)*8/1000)
 
+enum evt_family {
+	EVT_GUMBEL,
+	EVT_FRECHET,
+	EVT_GEV,
+
+	EVT_N_FAMILIES,
+	EVT_ALL = EVT_N_FAMILIES, /* fit all, pick best AIC */
+};
+
+extern const char *evt_family_names[];
+
+enum gof_test {
+	GOF_AD,
+	GOF_KS,
+	GOF_CHI2,
+
+	GOF_N_TESTS,
+};
+
+extern const char *gof_names[];
+
+enum out_format {
+	FMT_TEXT,
+	FMT_BIN, /* raw little-endian */
+	FMT_NPY,
+
+	FMT_N,
+};
+
+extern const char *format_names[];
+
+enum img_format {
+	IMG_PNG,
+	IMG_PPM,
+	IMG_PGM,
+
+	IMG_N,
+};
+
+extern const char *img_format_names[];
+
+enum event_type {
+	EV_NOTIF,
+	EV_SKIP, /* double skip */
+	EV_FIXUP, /* tx_ts fixed up, val is the IFG error before */
+	EV_IFG, /* IFG violation, val is the error */
+	EV_XCEED0, /* above --xceed, EV_XCEED0 + trace, val is the delay */
+
+	EV_N = EV_XCEED0 + MAX_TRACES,
+};
+
+extern const char *event_names[];
+
+enum stage {
+	STAGE_DECODE,
+	STAGE_MOMENTS,
+	STAGE_DISTR,
+	STAGE_SVT,
+	STAGE_CORR,
+	STAGE_EVT,
+	STAGE_POT,
+	STAGE_BOOT,
+	STAGE_PYR,
+	STAGE_PYR2,
+	STAGE_CPD,
+
+	STAGE_N,
+};
+
+#define STG(_s_)	(1U << STAGE_##_s_)
+
+extern const char *stage_names[];
+
+enum cpd_method {
+	CPD_PH,
+	CPD_PELT,
+
+	CPD_N,
+};
+
+extern const char *cpd_names[];
+
 struct cmdline_args {
 	bool quiet;
 
 	int ifg;
 	unsigned skip_notif;
 	unsigned skip_begin;
+	bool index; /* write <file>.idx while parsing */
+	unsigned index_stride;
+	struct sub_range {
+		u32 pair[2];
+		u64 clk[2]; /* since the first result */
+	} range; /* [from, to) pairs, [from, to] in time */
 	char *res_pfx;
 	char *res_dir;
+	char *cmp_pfx;
+	char *cmp_dir;
 
 	bool rebalance;
 
+	u32 n_duts;
+	u8 dut_key[MAX_DUTS]; /* key byte of each DUT's result frames */
+	u32 n_traces; /* DUTs, min and max if more than 2 DUTs */
+
+	unsigned jobs;
+	bool stream;
+	unsigned mem_budget; /* MiB */
+	char *scratch;
+
+	char *manifest;
+	bool watch;
+	char *serve;
+	char *store; /* results store to append to */
+	char *campaign;
+	char *query; /* results store to query */
+	char *q_where;
+	char *q_select;
+	char *q_group;
+	bool global;
+	unsigned preview;
+	bool refine;
+
+	bool dry_run;
+	u32 stages; /* plan, mask of STG() */
+
 	unsigned svt_block;
 
+	enum evt_family evt_family;
+	enum gof_test gof;
+	bool pot;
+	unsigned boot_reps;
+
+	u32 xceed[MAX_TRACES]; /* per trace thresholds, 0 for none */
+
+	char *jitter; /* also mirror outputs for jitter traces here */
+
 	char *raw;
+	char *events;
+	char *plot;
+	unsigned plot_width;
 	char *distr;
 	char *hm;
+	unsigned hm_log; /* cells per octave */
+	bool hm_sparse;
+	char *hm_img;
+	u32 img_w, img_h;
+	u32 img_range[4]; /* t0 from, t0 to, t1 from, t1 to */
+	enum img_format img_format;
 	char *stats;
 	char *svt_dir;
+	char *changes;
+	double cpd_thr;
 	int aggr;
+	enum out_format format;
 };
 
 extern struct cmdline_args args;
@@ -107,6 +251,7 @@ struct delay {
 		/* fitted EVT distribution */
 		struct evt_distr {
 			bool ok;
+			enum evt_family family;
 
 			double m;
 			double s;
@@ -114,28 +259,105 @@ struct delay {
 
 			u32 block_size;
 			double xceed;
+			double llh; /* log-likelihood of the fit */
 		} ed;
 
+		/* peaks-over-threshold GPD fit */
+		struct pot_distr {
+			bool ok;
+
+			double u; /* threshold */
+			double sigma;
+			double xi;
+
+			u32 n_exc;
+			double xceed;
+			double llh;
+		} pot;
+
+		/* bootstrap confidence intervals of ed, [0] low, [1] high */
+		struct evt_ci {
+			u32 n_reps;
+
+			double m[2];
+			double s[2];
+			double a[2];
+			double xceed[2];
+		} ed_ci;
+
+		/* first svt block of each segment, per change detector */
+		u32 *cps[CPD_N];
+		struct cpd *cpd_; /* while blocks are being fed */
+
 		/* aggregated distribution (not to args.aggr, just cnt) */
 		struct distribution {
 			u32 val;
 			u32 cnt;
 		} *distr;
+		/* block maxima histogram ed was fitted to */
+		struct distribution *maxes;
+		/* distr at all power-of-two resolutions */
+		struct pyramid *pyr;
 
 		u32 *samples;
-	} t[3];
+		int spill_fd_; /* backing file of samples with --scratch */
+		u32 spill_size_; /* samples mapped, traces grow one by one */
+		u32 stages_done_; /* computed online while decoding */
+	} t[MAX_TRACES];
+	u32 n_traces;
+
+	/* t0 x t1 joint histogram at all power-of-two resolutions */
+	struct pyramid2 *pyr2;
+
+	struct event_index *events;
+
+	/* --jitter: tN gaps between results received by DUT N, the last
+	 * trace between their tx time stamps, same stages run on them
+	 */
+	struct delay *jit;
+
+	struct online *online_;
+	u32 stages_done_;
 };
 
 #define for_each_trace(_delay_, _trace_)			\
 	for (u32 macro_t_ = 0;					\
-	     _trace_ = &_delay_->t[macro_t_], macro_t_ < 3;	\
+	     _trace_ = &_delay_->t[macro_t_],			\
+	     macro_t_ < _delay_->n_traces;			\
 	     macro_t_++)
 
 #define for_each_trace_i(_delay_, _trace_, _i_)		\
 	for (_i_ = 0;					\
-	     _trace_ = &_delay_->t[_i_], _i_ < 3;	\
+	     _trace_ = &_delay_->t[_i_],		\
+	     _i_ < _delay_->n_traces;			\
 	     _i_++)
 
+#define PYR_MAX_LEVELS	27
+
+struct pyramid {
+	u32 base; /* value of bin 0 */
+	u32 n_levels;
+	u32 len[PYR_MAX_LEVELS];
+	u32 *lvl[PYR_MAX_LEVELS]; /* lvl[k][i] counts [base + i<<k, +1<<k) */
+};
+
+struct pyramid2 {
+	u32 base[2];
+	u32 n_levels[2];
+	u32 dim[2][PYR_MAX_LEVELS];
+	/* [kx * PYR_MAX_LEVELS + ky], row major with dim[1][ky] columns */
+	u32 *lvl[PYR_MAX_LEVELS * PYR_MAX_LEVELS];
+};
+
+struct event_index {
+	struct event {
+		u32 res; /* result # in the file */
+		u32 sample; /* # of samples loaded before */
+		u32 val;
+	} *ev[EV_N];
+	u32 n[EV_N];
+};
+
 struct delay_bank {
 	int n; /* count(bank) */
 
@@ -144,17 +366,209 @@ struct delay_bank {
 	struct delay **bank;
 };
 
+/* ccan/tal keeps its parent/child lists without any locking, tal calls
+ * made from pool tasks have to hold tal_lock.
+ */
+extern pthread_mutex_t tal_lock;
+
+#define tal_locked(_expr_)					\
+	({							\
+		__typeof__(_expr_) ret_;			\
+								\
+		pthread_mutex_lock(&tal_lock);			\
+		ret_ = (_expr_);				\
+		pthread_mutex_unlock(&tal_lock);		\
+		ret_;						\
+	})
+
+typedef void (*task_fn)(void *arg);
+
+struct task;
+
+struct task_group {
+	u32 pending;
+};
+
+struct task_log {
+	char *out;
+	size_t out_len;
+	char *err;
+	size_t err_len;
+};
+
+int pool_init(u32 n_workers);
+void pool_fini(void);
+u32 pool_size(void);
+struct task *task_new(task_fn fn, void *arg, struct task_group *grp,
+		      struct task_log *log);
+void task_after(struct task *t, struct task *dep);
+void task_submit(struct task *t);
+void task_spawn(task_fn fn, void *arg, struct task_group *grp,
+		struct task_log *log);
+void pool_wait(struct task_group *grp);
+void task_log_flush(struct task_log *log);
+
+struct wbuf {
+	FILE *f;
+	enum out_format fmt;
+	char *buf;
+	char *p;
+	bool err;
+
+	const char *dtype; /* .npy header */
+	u32 n_rows;
+	u32 n_cols;
+};
+
+int wb_open(struct wbuf *w, FILE *f, enum out_format fmt);
+int wb_close(struct wbuf *w);
+void wb_begin(struct wbuf *w, const char *dtype, u32 n_cols);
+void wb_char(struct wbuf *w, char c);
+void wb_eol(struct wbuf *w);
+void wb_u32(struct wbuf *w, u32 v);
+void wb_s32(struct wbuf *w, s32 v);
+void wb_dbl(struct wbuf *w, double v, char conv);
+void wb_printf(struct wbuf *w, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+void event_add(struct delay *d, enum event_type type, u32 res, u32 val);
+u32 event_count(const struct delay *d, enum event_type type);
+u32 event_lower_bound(const struct delay *d, enum event_type type, u32 res);
+int write_events(const struct delay *d, struct wbuf *w);
+void write_bad_periods(const struct delay *d, u32 tr, u32 gap,
+		       u32 from, u32 to, struct wbuf *w);
+
+int store_append(const char *path, const char *campaign,
+		 const struct delay_bank *db);
+int store_query(const char *path, const char *where, const char *select,
+		const char *group_by);
+
+int write_downsampled(const struct delay *d, struct wbuf *w, u32 width);
+
+struct hist2d;
+
+struct hist2d *hist2d_new(const void *ctx, const u32 lo[2], const u32 hi[2],
+			  u32 aggr, u32 log);
+void hist2d_add(struct hist2d *h, u32 x, u32 y);
+void hist2d_write_dense(const struct hist2d *h, struct wbuf *w);
+void hist2d_write_sparse(const struct hist2d *h, struct wbuf *w);
+
+int render_hm(const struct delay *d, const char *dir);
+
+int write_distr(const struct delay *d, struct wbuf *w, u32 aggr,
+		u32 from, u32 to);
+int write_hm(const struct delay *d, struct wbuf *w, u32 aggr,
+	     u32 x_from, u32 x_to, u32 y_from, u32 y_to);
+int serve(const struct delay_bank *db, const char *path);
+
+struct stat;
+struct manifest;
+
+struct manifest *manifest_load(const char *path);
+const char *manifest_fresh(struct manifest *m, const char *name,
+			   const struct stat *st);
+bool is_manifest_file(const struct manifest *m, const char *name);
+void manifest_report(const struct manifest *m);
+void manifest_update(struct manifest *m, const char *name,
+		     const struct stat *st, const struct delay *d);
+int manifest_save(struct manifest *m);
+
+u32 plan_closure(u32 stages);
+void plan_print(const char *what, u32 stages);
+
+#define planned(_s_)	(args.stages & STG(_s_))
+
 float chi2_read(unsigned df);
 
-struct delay *read_delay(const char *fname);
+void compare_banks(const struct delay_bank *a, const struct delay_bank *b);
+
+struct delay *read_delay(const char *path);
+void delay_release_samples(struct delay *d);
+
+/* On-disk layout of <file>.idx, native byte order */
+struct frame_index_hdr {
+	char magic[8];
+	u32 stride; /* frame pairs between entries */
+	u32 n_ent;
+	u64 size; /* of the capture */
+	s64 mtime;
+	s32 ifg;
+	u32 skip_notif;
+	u32 n_duts;
+	u32 pad;
+};
+
+struct frame_index_ent {
+	u64 offset; /* of the record to restart reading from */
+	u64 elapsed; /* clocks since the first result */
+	u64 p_tx_ts; /* previous result, for unwrapping */
+	u64 p_rx_ts[MAX_DUTS];
+	u32 pair;
+	u32 res; /* # of results before */
+	u32 last_tx;
+	u32 skip_after_notif;
+	u8 is_first;
+	u8 seen_tx;
+	u8 pad[6];
+};
+
+struct frame_index {
+	struct frame_index_hdr hdr;
+	struct frame_index_ent *ent;
+};
+
+bool is_index_file(const char *name);
+struct frame_index *frame_index_new(u32 stride);
+void frame_index_add(struct frame_index *fi, const struct frame_index_ent *e);
+int frame_index_save(struct frame_index *fi, const char *path);
+struct frame_index *frame_index_load(const char *path);
+const struct frame_index_ent *
+frame_index_find(const struct frame_index *fi, u32 pair, u64 clk);
+
+struct frame_map;
+
+struct frame_map *frame_map_open(const char *path);
+u32 frame_map_n_pairs(const struct frame_map *fm);
+void frame_map_stride(const struct frame_map *fm, u32 stride);
+int frame_map_pair(const struct frame_map *fm, u32 p,
+		   u32 out[FRAME_N_RES][MAX_TRACES]);
+int preview_file(const char *path, u32 stride, bool refine);
 
 void calc_distr(struct trace *t);
 void calc_mean(struct trace *t, u32 n_samples);
 void calc_stdev(struct trace *t, u32 n_samples);
 void calc_gumbel(struct trace *t, u32 n_samples);
+double fit_quality(enum evt_family fam, const struct distribution *distr,
+		   u32 n, double a, double s, double m);
+void fit_evt(struct evt_distr *ed, const struct distribution *distr, u32 n);
+double evt_cdf(const struct evt_distr *ed, double x);
+double evt_xceed(const struct evt_distr *ed, double p);
+double evt_aic(const struct evt_distr *ed);
+void calc_pot(struct trace *t, u32 n_samples);
+void calc_bootstrap(struct trace *t);
+double pot_xceed(const struct trace *t, double p);
 void calc_corr(struct delay *d);
 void balance_means(struct delay *d);
 void calc_svt_basic(struct trace *t, u32 n_samples);
 void calc_svt_stdev(struct trace *t, u32 n_samples);
 void calc_svt_corr(struct delay *d);
+void calc_svt_block(struct trace *t, u32 i);
+void calc_svt_corr_block(struct delay *d, u32 i);
+bool svt_corr_valid(void);
+
+void cpd_block(struct trace *t, u32 b);
+void calc_changes(struct trace *t);
+int write_changes(const struct delay *d, struct wbuf *w);
+
+void calc_pyramid(struct trace *t);
+u64 pyramid_sum(const struct pyramid *p, u32 lo, u32 hi);
+void calc_pyramid2(struct delay *d);
+u64 pyramid2_sum(const struct pyramid2 *p, u32 x0, u32 x1, u32 y0, u32 y1);
+
+struct delay *merge_bank(const struct delay_bank *db);
+void calc_global(struct delay *g, u32 n_files);
+
+void online_start(struct delay *d);
+void online_push(struct delay *d);
+void online_finish(struct delay *d);
 #endif
@@ -0,0 +1,225 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Online stages for live inputs (stdin, FIFOs).  Moments, histograms,
+ * svt blocks and correlation are updated as samples are decoded so that
+ * by the end of the stream only EVT and outputs are left to do.  Sums are
+ * kept in integers relative to the first sample so they are exact.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+struct online_trace {
+	u32 shift;
+	s64 s1; /* sum of (x - shift) */
+	u64 s2; /* sum of (x - shift)^2 */
+
+	u32 *hist; /* dense, indexed by val - hist_min */
+	u32 hist_min;
+	u32 hist_len;
+};
+
+struct online {
+	u32 n_traces; /* t2 changes under rebalance, it's done offline */
+	u32 stages;
+	u32 svt_size;
+	bool svt_corr;
+
+	s64 s01; /* sum of (x0 - shift0) * (x1 - shift1) */
+	struct online_trace t[MAX_TRACES];
+};
+
+void online_start(struct delay *d)
+{
+	struct online *o = calloc(1, sizeof(*o));
+
+	o->n_traces = args.rebalance ? 2 : d->n_traces;
+	o->stages = args.stages & (STG(MOMENTS) | STG(DISTR) | STG(SVT) |
+				   STG(CORR) | STG(CPD));
+	o->svt_corr = o->stages & STG(SVT) && svt_corr_valid();
+
+	d->online_ = o;
+}
+
+static void hist_add(struct online_trace *ot, u32 x)
+{
+	u32 lo, hi, slack, *hist;
+
+	if (unlikely(x < ot->hist_min || x - ot->hist_min >= ot->hist_len)) {
+		/* grow by half of the range each way to amortise */
+		lo = ot->hist_len ? ot->hist_min : x;
+		hi = ot->hist_len ? ot->hist_min + ot->hist_len - 1 : x;
+		if (x < lo)
+			lo = x;
+		if (x > hi)
+			hi = x;
+		slack = (hi - lo) / 2 + 64;
+		lo = lo > slack ? lo - slack : 0;
+		hi = hi < ~0U - slack ? hi + slack : ~0U;
+
+		hist = calloc(hi - lo + 1, sizeof(*hist));
+		if (ot->hist_len)
+			memcpy(&hist[ot->hist_min - lo], ot->hist,
+			       ot->hist_len * sizeof(*hist));
+		free(ot->hist);
+		ot->hist = hist;
+		ot->hist_min = lo;
+		ot->hist_len = hi - lo + 1;
+	}
+
+	ot->hist[x - ot->hist_min]++;
+}
+
+static void online_block(struct delay *d, u32 b)
+{
+	struct online *o = d->online_;
+	u32 i;
+
+	if (b >= o->svt_size) {
+		o->svt_size = o->svt_size ? o->svt_size * 2 : 64;
+		for (i = 0; i < o->n_traces; i++)
+			if (d->t[i].svt_stats)
+				tal_locked(tal_resize(&d->t[i].svt_stats,
+						      o->svt_size));
+			else
+				d->t[i].svt_stats =
+					tal_locked(tal_arr(d,
+							   struct stats_vs_time,
+							   o->svt_size));
+		if (o->svt_corr && d->corr_vs_time)
+			tal_locked(tal_resize(&d->corr_vs_time, o->svt_size));
+		else if (o->svt_corr)
+			d->corr_vs_time = tal_locked(tal_arr(d, double,
+							     o->svt_size));
+	}
+
+	for (i = 0; i < o->n_traces; i++) {
+		calc_svt_block(&d->t[i], b);
+		if (o->stages & STG(CPD))
+			cpd_block(&d->t[i], b);
+	}
+	if (o->svt_corr)
+		calc_svt_corr_block(d, b);
+}
+
+/* Called for every sample pushed to @d. */
+void online_push(struct delay *d)
+{
+	struct online *o = d->online_;
+	const u32 n = d->n_samples - 1;
+	struct online_trace *ot;
+	s64 dx[MAX_TRACES];
+	u32 i, x;
+
+	for (i = 0; i < o->n_traces; i++) {
+		ot = &o->t[i];
+		x = d->t[i].samples[n];
+
+		if (!n)
+			ot->shift = x;
+		dx[i] = (s64)x - ot->shift;
+
+		if (o->stages & STG(MOMENTS)) {
+			ot->s1 += dx[i];
+			ot->s2 += dx[i] * dx[i];
+		}
+		if (o->stages & STG(DISTR))
+			hist_add(ot, x);
+	}
+
+	if (o->stages & STG(CORR))
+		o->s01 += dx[0] * dx[1];
+
+	if (o->stages & STG(SVT) && !(d->n_samples % args.svt_block))
+		online_block(d, d->n_samples / args.svt_block - 1);
+}
+
+static struct distribution *hist_distr(struct delay *d,
+				       const struct online_trace *ot)
+{
+	struct distribution *distr;
+	u32 i, n_distinct = 0;
+
+	for (i = 0; i < ot->hist_len; i++)
+		n_distinct += !!ot->hist[i];
+
+	distr = tal_locked(tal_arr(d, struct distribution, n_distinct));
+	for (i = 0, n_distinct = 0; i < ot->hist_len; i++)
+		if (ot->hist[i]) {
+			distr[n_distinct].val = ot->hist_min + i;
+			distr[n_distinct].cnt = ot->hist[i];
+			n_distinct++;
+		}
+
+	return distr;
+}
+
+/* Turn the running sums into final stats, mark what doesn't need redoing. */
+void online_finish(struct delay *d)
+{
+	struct online *o = d->online_;
+	const u32 n = d->n_samples;
+	const u32 n_blocks = args.svt_block ? n / args.svt_block : 0;
+	struct online_trace *ot;
+	struct trace *t;
+	u32 i;
+
+	d->online_ = NULL;
+
+	for (i = 0; n && i < o->n_traces; i++) {
+		t = &d->t[i];
+		ot = &o->t[i];
+
+		if (o->stages & STG(MOMENTS)) {
+			t->sum = (u64)ot->shift * n + ot->s1;
+			t->mean = (double)t->sum / n;
+			t->stdev_sum = ot->s2 - (double)ot->s1 * ot->s1 / n;
+			t->stdev = sqrt(t->stdev_sum / (n - 1));
+		}
+		if (o->stages & STG(DISTR))
+			t->distr = hist_distr(d, ot);
+		if (o->stages & STG(SVT)) {
+			if (t->svt_stats)
+				tal_locked(tal_resize(&t->svt_stats,
+						      n_blocks));
+			else
+				t->svt_stats =
+					tal_locked(tal_arr(d,
+							   struct stats_vs_time,
+							   0));
+		}
+		t->stages_done_ = o->stages & ~STG(CORR);
+	}
+
+	if (n && o->stages & STG(CORR)) {
+		d->corr = (o->s01 - (double)o->t[0].s1 * o->t[1].s1 / n) /
+			(sqrt(d->t[0].stdev_sum) * sqrt(d->t[1].stdev_sum));
+		d->stages_done_ |= STG(CORR);
+	}
+
+	if (n && o->svt_corr && d->corr_vs_time)
+		tal_locked(tal_resize(&d->corr_vs_time, n_blocks));
+
+	for (i = 0; i < MAX_TRACES; i++)
+		free(o->t[i].hist);
+	free(o);
+}
@@ -18,6 +18,10 @@
 #include "mgr_interp.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <pcap.h>
 
@@ -25,10 +29,10 @@
 #include <ccan/tal/tal.h>
 #include <ccan/tal/str/str.h>
 
-#define pinf(msg_)	({						\
-	  if (!args.quiet)						\
-		  printf(msg_ " [pair %u]\n", sc->d->n_samples);	\
-	  })
+#define pinf(msg_)	msg(msg_ " [pair %u]\n", sc->d->n_samples)
+
+#define PCAP_HDR_LEN	24
+#define PCAP_REC_HDR	16
 
 /* Actual packet structures, note that all fields are in network order. */
 struct result {
@@ -36,7 +40,7 @@ struct result {
 	uint32_t tx_ts;
 };
 
-#define FR_N_RES 128
+#define FR_N_RES FRAME_N_RES
 
 struct result_frame {
 	struct result r[FR_N_RES];
@@ -44,21 +48,16 @@ struct result_frame {
 	uint64_t ts;
 } __attribute__ ((packed));
 
-/* Wait queue to match stats from different DUTs */
-struct list_head g_pkt_queue[2] = {
-	LIST_HEAD_INIT(g_pkt_queue[0]),
-	LIST_HEAD_INIT(g_pkt_queue[1])
-};
-
 struct enqueued_frame {
 	struct list_node node;
+	u64 offset; /* in the file */
 	struct result_frame fr;
 } __attribute__ ((packed));
 
 /* Program samples, struct result is translated to this one. */
 struct sample {
 	u64 tx_ts;    /* True tx time stamp. */
-	u64 rx_ts[2]; /* RX time stamps for machines. */
+	u64 rx_ts[MAX_DUTS]; /* RX time stamps for machines. */
 };
 
 struct sample_context {
@@ -69,84 +68,238 @@ struct sample_context {
 	bool is_first;
 	bool is_notif;
 	struct sample c, p; /* current and previos sample. */
+	bool saved, p_saved; /* c, p made it into the traces */
+
+	/* Wait queues to match stats from different DUTs */
+	struct list_head pkt_queue[MAX_DUTS];
+	u32 queued; /* mask of non-empty queues */
+	s8 key_dut[256];
+
+	u32 pair; /* frame pairs seen */
+	u32 res; /* results seen */
+	u64 elapsed; /* clocks since the first result */
+	u32 last_tx;
+	bool seen_tx;
+	bool skim; /* before --from, only track state */
+	bool done; /* past --to */
+
+	FILE *f; /* to tell offsets, NULL if not seekable */
+	struct frame_index *idx; /* being built */
+	u32 idx_next; /* pair # of the next entry */
 
 	struct delay *d;
 };
 
-static void delay_trace_grow(struct delay *d)
+/* DUT # by result frame key, -1 for keys of no DUT */
+static void key_map_init(s8 key_dut[256])
 {
-	int i;
+	u32 i;
+
+	memset(key_dut, -1, 256);
+	for (i = 0; i < args.n_duts; i++)
+		key_dut[args.dut_key[i]] = i;
+}
+
+static void delay_unspill(struct delay *d)
+{
+	struct trace *t;
+
+	for_each_trace(d, t) {
+		if (!t->samples)
+			continue;
+		munmap(t->samples, (size_t)t->spill_size_ * sizeof(u32));
+		close(t->spill_fd_);
+		t->samples = NULL;
+		t->spill_size_ = 0;
+	}
+}
+
+/* With --scratch sample columns live in unlinked files mapped into memory,
+ * the page cache writes them out as needed so traces can outgrow RAM.
+ */
+static int trace_spill_grow(struct trace *t, u32 old_size, u32 new_size)
+{
+	const size_t old_sz = (size_t)old_size * sizeof(u32);
+	const size_t new_sz = (size_t)new_size * sizeof(u32);
+	char *path;
+	void *p;
+	int ret;
+
+	if (!old_size) {
+		path = tal_locked(tal_fmt(NULL, "%s/mgr_interp.XXXXXX",
+					  args.scratch));
+		t->spill_fd_ = mkstemp(path);
+		if (t->spill_fd_ >= 0)
+			unlink(path);
+		tal_locked(tal_free(path));
+		if (t->spill_fd_ < 0)
+			return perr_ret("Could not create scratch file");
+	}
+
+	if (ftruncate(t->spill_fd_, new_sz)) {
+		ret = perr_ret("Could not grow scratch file");
+		goto err_close;
+	}
+
+	if (!old_size)
+		p = mmap(NULL, new_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 t->spill_fd_, 0);
+	else
+		p = mremap(t->samples, old_sz, new_sz, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED) {
+		ret = perr_ret("Could not map scratch file");
+		goto err_close;
+	}
+
+	madvise(p, new_sz, MADV_SEQUENTIAL);
+	t->samples = p;
+	t->spill_size_ = new_size;
+
+	return 0;
+
+err_close:
+	/* a mapping that failed to grow is still there at its old size */
+	if (!old_size)
+		close(t->spill_fd_);
+	return ret;
+}
 
-	if (!d->trace_size_) {
-		d->trace_size_ = 2048;
-		for (i = 0; i < 3; i++)
-			d->t[i].samples = tal_arr(d, u32, d->trace_size_);
+static int delay_trace_grow(struct delay *d)
+{
+	const u32 old_size = d->trace_size_;
+	u32 i;
+
+	d->trace_size_ = old_size ? old_size * 2 : 2048;
+
+	if (args.scratch) {
+		if (!old_size)
+			tal_locked(tal_add_destructor(d, delay_unspill));
+		for (i = 0; i < d->n_traces; i++)
+			if (trace_spill_grow(&d->t[i], old_size,
+					     d->trace_size_)) {
+				d->trace_size_ = old_size;
+				return 1;
+			}
+	} else if (!old_size) {
+		for (i = 0; i < d->n_traces; i++)
+			d->t[i].samples =
+				tal_locked(tal_arr(d, u32, d->trace_size_));
 	} else {
-		d->trace_size_ *= 2;
-		for (i = 0; i < 3; i++)
-			tal_resize(&d->t[i].samples, d->trace_size_);
+		for (i = 0; i < d->n_traces; i++)
+			tal_locked(tal_resize(&d->t[i].samples,
+					      d->trace_size_));
 	}
+
+	return 0;
 }
 
-static inline void delay_push(struct delay *d, u32 t1, u32 t2, u32 t3)
+static inline int delay_push(struct delay *d, const u32 *val)
 {
-	int i;
+	u32 i;
 	struct trace *t;
-	const u32 tmp_arr[] = { t1, t2, t3 };
 
 	assert(d->trace_size_ >= d->n_samples);
 
-	if (unlikely(d->trace_size_ == d->n_samples))
-		delay_trace_grow(d);
+	if (unlikely(d->trace_size_ == d->n_samples) &&
+	    delay_trace_grow(d))
+		return 1;
 
 	for_each_trace_i(d, t, i) {
-		t->samples[d->n_samples] = tmp_arr[i];
+		t->samples[d->n_samples] = val[i];
 
-		if (tmp_arr[i] < t->min)
-			t->min = tmp_arr[i];
-		if (tmp_arr[i] > t->max)
-			t->max = tmp_arr[i];
+		if (val[i] < t->min)
+			t->min = val[i];
+		if (val[i] > t->max)
+			t->max = val[i];
 	}
 	d->n_samples++;
+
+	if (d->online_)
+		online_push(d);
+
+	return 0;
 }
 
 static void sc_reset(struct sample_context *sc, struct delay *d, pcap_t *pcap)
 {
+	u32 i;
+
 	memset(sc, 0, sizeof(*sc));
 
 	sc->d = d;
 	sc->pcap = pcap;
 	sc->is_first = true;
+	for (i = 0; i < MAX_DUTS; i++)
+		list_head_init(&sc->pkt_queue[i]);
+	key_map_init(sc->key_dut);
 }
 
 static inline void sc_next(struct sample_context *sc)
 {
 	sc->p = sc->c;
+	sc->p_saved = sc->saved;
 
-	sc->is_notif = sc->is_first = false;
+	sc->is_notif = sc->is_first = sc->saved = false;
 
 	if (unlikely(sc->skip_after_notif))
 		sc->skip_after_notif--;
 }
 
 static inline void sc_load_res(struct sample_context *sc,
-			       const struct result r1, const struct result r2)
+			       struct result_frame *const *fr, u32 i)
+{
+	u32 j;
+
+	sc->is_notif = false;
+	sc->c.tx_ts = 0;
+	for (j = 0; j < args.n_duts; j++) {
+		sc->is_notif |= !fr[j]->r[i].tx_ts;
+		if (!sc->c.tx_ts)
+			sc->c.tx_ts = ntohl(fr[j]->r[i].tx_ts);
+		sc->c.rx_ts[j] = ntohl(fr[j]->r[i].rx_ts);
+	}
+}
+
+/* All DUTs have to have seen the same tx time stamp, bar notifs */
+static inline bool sc_tx_mismatch(const struct sample_context *sc,
+				  struct result_frame *const *fr, u32 i)
+{
+	u32 j;
+
+	if (sc->is_notif)
+		return false;
+	for (j = 1; j < args.n_duts; j++)
+		if (fr[j]->r[i].tx_ts != fr[0]->r[i].tx_ts)
+			return true;
+
+	return false;
+}
+
+static inline void sc_event(const struct sample_context *sc,
+			    enum event_type type, u32 val)
 {
-	sc->is_notif = !r1.tx_ts || !r2.tx_ts;
+	if (!sc->skim)
+		event_add(sc->d, type, sc->res, val);
+}
+
+static inline void sc_track_time(struct sample_context *sc)
+{
+	if (!sc->c.tx_ts)
+		return;
 
-	sc->c.tx_ts = ntohl(r1.tx_ts) ?: ntohl(r2.tx_ts);
-	sc->c.rx_ts[0] = ntohl(r1.rx_ts);
-	sc->c.rx_ts[1] = ntohl(r2.rx_ts);
+	if (sc->seen_tx)
+		sc->elapsed += (u32)(sc->c.tx_ts - sc->last_tx);
+	sc->last_tx = sc->c.tx_ts;
+	sc->seen_tx = true;
 }
 
 static inline int sc_check_user_skip(struct sample_context *sc)
 {
-	/* n_real_samples is increamented before this func hence '<=' */
-	if (unlikely(sc->d->n_real_samples <= args.skip_begin))
+	if (unlikely(sc->res < args.skip_begin))
 		return 1;
 
 	if (sc->is_notif) {
-		if (sc->skip_after_notif)
+		if (sc->skip_after_notif && !sc->skim)
 			err("\tNotif on notif!!\n");
 		sc->skip_after_notif = args.skip_notif;
 	}
@@ -160,8 +313,10 @@ static inline int sc_check_user_skip(struct sample_context *sc)
 static inline int sc_check_double_skip(const struct sample_context *sc)
 {
 	if (unlikely(!sc->c.tx_ts)) {
-		if (!sc->is_first)
+		if (!sc->is_first && !sc->skim) {
 			err("\tFIXME: Double skip, ignoring sample\n");
+			sc_event(sc, EV_SKIP, 0);
+		}
 
 		return 1;
 	}
@@ -180,9 +335,11 @@ static inline void unwrap_time_(u64 *prev, u64 *curr)
 
 static inline void sc_unwrap_time(struct sample_context *sc)
 {
+	u32 j;
+
 	unwrap_time_(&sc->p.tx_ts, &sc->c.tx_ts);
-	unwrap_time_(&sc->p.rx_ts[0], &sc->c.rx_ts[0]);
-	unwrap_time_(&sc->p.rx_ts[1], &sc->c.rx_ts[1]);
+	for (j = 0; j < args.n_duts; j++)
+		unwrap_time_(&sc->p.rx_ts[j], &sc->c.rx_ts[j]);
 }
 
 static inline void sc_check_ifg(struct sample_context *sc)
@@ -196,37 +353,120 @@ static inline void sc_check_ifg(struct sample_context *sc)
 
 	if (unlikely(expected_ts_diff < -0x900 &&
 		     expected_ts_diff > -0x1100)) {
-		pinf("\tFixup tx_ts");
+		if (!sc->skim)
+			pinf("\tFixup tx_ts");
+		sc_event(sc, EV_FIXUP, expected_ts_diff);
 		sc->c.tx_ts ^= 0x1000;
 		expected_ts_diff = sc->p.tx_ts + args.ifg - sc->c.tx_ts;
 	}
 
 	if (unlikely(expected_ts_diff < -0x100 ||
-		     expected_ts_diff >  0x100)) {
+		     expected_ts_diff >  0x100) && !sc->skim) {
 		msg("\tBroken tx_ts %" PRId64 " [pair %u]\n", expected_ts_diff, sc->d->n_samples);
+		sc_event(sc, EV_IFG, expected_ts_diff);
 	}
 }
 
-static inline void sc_save_deltas(struct sample_context *sc)
+/* Delays of all DUTs then min and, for more than 2 DUTs, max of them */
+static inline int sc_save_deltas(struct sample_context *sc)
+{
+	const u32 n = args.n_duts;
+	u32 val[MAX_TRACES], min = ~0U, max = 0, j;
+
+	for (j = 0; j < n; j++) {
+		val[j] = sc->c.rx_ts[j] - sc->c.tx_ts;
+		min = val[j] < min ? val[j] : min;
+		max = val[j] > max ? val[j] : max;
+	}
+	val[n] = min;
+	val[n + 1] = max;
+
+	for (j = 0; j < args.n_traces; j++)
+		if (unlikely(args.xceed[j] && val[j] > args.xceed[j]))
+			sc_event(sc, EV_XCEED0 + j, val[j]);
+
+	if (delay_push(sc->d, val))
+		return 1;
+	sc->saved = true;
+
+	/* gaps only between results next to each other */
+	if (!sc->d->jit || !sc->p_saved)
+		return 0;
+
+	for (j = 0; j < n; j++)
+		val[j] = sc->c.rx_ts[j] - sc->p.rx_ts[j];
+	val[n] = sc->c.tx_ts - sc->p.tx_ts;
+
+	return delay_push(sc->d->jit, val);
+}
+
+/* Called before the first frame of sc->pair is read, @offset is where
+ * that frame starts.  Frames of this pair may already be queued, then
+ * reading has to restart from the oldest of them.
+ */
+static void sc_index_pair(struct sample_context *sc, u64 offset)
+{
+	struct frame_index_ent e = {};
+	struct enqueued_frame *q;
+	u32 i;
+
+	for (i = 0; i < args.n_duts; i++) {
+		q = list_top(&sc->pkt_queue[i], struct enqueued_frame, node);
+		if (q && q->offset < offset)
+			offset = q->offset;
+	}
+
+	e.offset = offset;
+	e.elapsed = sc->elapsed;
+	e.p_tx_ts = sc->p.tx_ts;
+	for (i = 0; i < args.n_duts; i++)
+		e.p_rx_ts[i] = sc->p.rx_ts[i];
+	e.pair = sc->pair;
+	e.res = sc->res;
+	e.last_tx = sc->last_tx;
+	e.skip_after_notif = sc->skip_after_notif;
+	e.is_first = sc->is_first;
+	e.seen_tx = sc->seen_tx;
+	frame_index_add(sc->idx, &e);
+
+	sc->idx_next += sc->idx->hdr.stride;
+}
+
+static void sc_seek(struct sample_context *sc, const struct frame_index_ent *e)
 {
-	u32 d1, d2, min;
+	u32 i;
 
-	d1 = sc->c.rx_ts[0] - sc->c.tx_ts;
-	d2 = sc->c.rx_ts[1] - sc->c.tx_ts;
-	min = d1 < d2 ? d1 : d2;
+	if (fseeko(sc->f, e->offset, SEEK_SET)) {
+		err("Seeking failed, reading from the start\n");
+		return;
+	}
 
-	delay_push(sc->d, d1, d2, min);
+	sc->elapsed = e->elapsed;
+	sc->p.tx_ts = e->p_tx_ts;
+	for (i = 0; i < args.n_duts; i++)
+		sc->p.rx_ts[i] = e->p_rx_ts[i];
+	sc->pair = e->pair;
+	sc->res = e->res;
+	sc->last_tx = e->last_tx;
+	sc->skip_after_notif = e->skip_after_notif;
+	sc->is_first = e->is_first;
+	sc->seen_tx = e->seen_tx;
 }
 
+/* Frames of one pair, one from every DUT, are matched by key.  A frame
+ * waits in its DUT's queue until all other queues have one, queues are
+ * tracked in a bitmask so the work per frame is the same for any # of DUTs.
+ */
 static void packet_cb(u_char *data, const struct pcap_pkthdr *header,
 		      const u_char *packet)
 {
 	struct sample_context *sc = (void *)data;
 	struct delay *d = sc->d;
-	struct result_frame *fr = (void *)packet, *dut1, *dut2;
-	struct enqueued_frame *ofr;
-	u8 src, other;
-	int i;
+	struct result_frame *fr = (void *)packet, *dut[MAX_DUTS];
+	struct enqueued_frame *ofr[MAX_DUTS] = {};
+	u32 others, j;
+	u64 offset = 0;
+	int i, src;
 
 	if (header->len != sizeof(*fr)) {
 		err("Wrong sized packet: %d!\n", header->len);
@@ -234,44 +474,77 @@ static void packet_cb(u_char *data, const struct pcap_pkthdr *header,
 		return;
 	}
 
-	src = fr->key & 1;
-	other = src ^ 1;
+	if (unlikely(sc->pair >= args.range.pair[1])) {
+		sc->done = true;
+		pcap_breakloop(sc->pcap);
+		return;
+	}
+
+	if (sc->f)
+		offset = ftello(sc->f) - PCAP_REC_HDR - header->caplen;
+	if (sc->idx && sc->pair == sc->idx_next)
+		sc_index_pair(sc, offset);
+
+	src = sc->key_dut[fr->key];
+	if (src < 0) {
+		pinf("Keys wrong!");
+		pcap_breakloop(sc->pcap);
+		return;
+	}
+	others = ((1U << args.n_duts) - 1) & ~(1U << src);
 
-	/* If other DUT's result isn't in yet, enqueue packet and wait. */
-	if (list_empty(&g_pkt_queue[other])) {
+	/* If other DUTs' results aren't in yet, enqueue packet and wait. */
+	if ((sc->queued & others) != others) {
 		struct enqueued_frame *copy = malloc(sizeof(*copy));
 
+		copy->offset = offset;
 		memcpy(&copy->fr, packet, header->len);
 
-		if (!list_empty(&g_pkt_queue[src]))
+		if (sc->queued & 1U << src)
 			msg("Multi enqueue %u\n", d->n_samples/128);
-		list_add_tail(&g_pkt_queue[src], &copy->node);
+		list_add_tail(&sc->pkt_queue[src], &copy->node);
+		sc->queued |= 1U << src;
 
 		return;
 	}
 
-	ofr = list_pop(&g_pkt_queue[other], struct enqueued_frame, node);
-
-	dut1 = src ? fr : &ofr->fr;
-	dut2 = other ? fr : &ofr->fr;
-	if (dut1->key != 0x55 || dut2->key != 0xaa) {
-		pinf("Keys wrong!");
-		pcap_breakloop(sc->pcap);
-		goto cb_out;
+	for (j = 0; j < args.n_duts; j++) {
+		if (j == (u32)src) {
+			dut[j] = fr;
+			continue;
+		}
+		ofr[j] = list_pop(&sc->pkt_queue[j], struct enqueued_frame,
+				  node);
+		dut[j] = &ofr[j]->fr;
+		if (list_empty(&sc->pkt_queue[j]))
+			sc->queued &= ~(1U << j);
 	}
 
-	for (i = 0; i < FR_N_RES; i++, sc_next(sc)) {
-		sc_load_res(sc, dut1->r[i], dut2->r[i]);
+	for (i = 0; i < FR_N_RES; i++, sc->res++, sc_next(sc)) {
+		sc_load_res(sc, dut, i);
 
-		if (dut1->r[i].tx_ts != dut2->r[i].tx_ts && !sc->is_notif) {
+		if (sc_tx_mismatch(sc, dut, i)) {
 			pinf("Frame tx ts mismatch");
 			pcap_breakloop(sc->pcap);
 			goto cb_out;
 		}
 
-		if (sc->is_notif)
-			d->n_notifs++;
-		d->n_real_samples++;
+		sc_track_time(sc);
+		if (unlikely(sc->elapsed > args.range.clk[1])) {
+			sc->done = true;
+			pcap_breakloop(sc->pcap);
+			goto cb_out;
+		}
+		sc->skim = sc->pair < args.range.pair[0] ||
+			sc->elapsed < args.range.clk[0];
+
+		if (!sc->skim) {
+			d->n_real_samples++;
+			if (sc->is_notif) {
+				d->n_notifs++;
+				sc_event(sc, EV_NOTIF, 0);
+			}
+		}
 
 		if (sc_check_double_skip(sc))
 			continue;
@@ -282,48 +555,336 @@ static void packet_cb(u_char *data, const struct pcap_pkthdr *header,
 
 		sc_check_ifg(sc);
 
-		sc_save_deltas(sc);
+		if (sc->skim)
+			continue;
+
+		if (sc_save_deltas(sc)) {
+			pcap_breakloop(sc->pcap);
+			goto cb_out;
+		}
 	}
+	sc->pair++;
 
 cb_out:
-	free(ofr);
+	for (j = 0; j < args.n_duts; j++)
+		free(ofr[j]);
 }
 
-struct delay *read_delay(const char *fname)
+static bool range_given(void)
+{
+	return args.range.pair[0] || args.range.clk[0] ||
+		args.range.pair[1] != ~0U || args.range.clk[1] != ~0ULL;
+}
+
+/* Position the parser at the start of the sub-range if there's an index,
+ * build a new index if asked to and the whole file is read.
+ */
+static void sc_setup_index(struct sample_context *sc, const char *path)
+{
+	const struct frame_index_ent *e;
+	struct frame_index *fi;
+
+	if (!sc->f)
+		return;
+
+	if (!range_given()) {
+		if (args.index)
+			sc->idx = frame_index_new(args.index_stride ?: 1);
+		return;
+	}
+
+	fi = frame_index_load(path);
+	if (!fi)
+		return;
+
+	e = frame_index_find(fi, args.range.pair[0], args.range.clk[0]);
+	if (e)
+		sc_seek(sc, e);
+	tal_locked(tal_free(fi));
+}
+
+static struct delay *delay_new(const void *ctx, const char *fname,
+			       u32 n_traces)
 {
-	int res;
 	struct delay *d;
 	struct trace *t;
+
+	d = tal_locked(talz(ctx, struct delay));
+	d->fname = tal_locked(tal_strdup(d, fname));
+	d->n_traces = n_traces;
+	for_each_trace(d, t) {
+		t->d = d;
+		t->min = -1;
+	}
+
+	return d;
+}
+
+struct delay *read_delay(const char *path)
+{
+	const char *fname = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	struct stat st;
+	int res;
+	struct delay *d;
 	pcap_t *pcap_src = NULL;
 	char errbuf[PCAP_ERRBUF_SIZE];
 	struct sample_context sc;
 
+	/* pcap reads stdin for "-" */
+	if (!strcmp(path, "-"))
+		fname = "stdin";
+
 	msg(FBOLD "Loading file %s\n" FNORM FYLW, fname);
 
-	pcap_src = pcap_open_offline(fname, errbuf);
+	pcap_src = pcap_open_offline(path, errbuf);
 	if (!pcap_src)
 		return err_nret("Could not load packets: %s\n", errbuf);
 
-	d = talz(NULL, struct delay);
-	d->fname = tal_strdup(d, fname);
-	for_each_trace(d, t) {
-		t->d = d;
-		t->min = -1;
-	}
+	d = delay_new(NULL, fname, args.n_traces);
+	if (args.jitter)
+		d->jit = delay_new(d, fname, args.n_duts + 1);
 	sc_reset(&sc, d, pcap_src);
 
+	/* Live inputs get analysed while they are being written. */
+	if (!strcmp(path, "-") || (!stat(path, &st) && S_ISFIFO(st.st_mode)))
+		online_start(d);
+	else if (!stat(path, &st) && S_ISREG(st.st_mode))
+		sc.f = pcap_file(pcap_src);
+	sc_setup_index(&sc, path);
+
 	res = pcap_loop(pcap_src, PCAP_CNT_INF, packet_cb, (void *)&sc);
-	if (res) {
+	if (res && !sc.done) {
 		/* Print pcap msg if break was due to internal pcap error. */
 		if (res == -1)
 			pcap_perror(pcap_src, "Error while reading packets");
-		tal_free(d);
+		if (d->online_)
+			online_finish(d);
+		tal_locked(tal_free(d));
 		d = NULL;
+	} else {
+		if (d->online_)
+			online_finish(d);
+		msg(FGRN "\tLoaded %d samples [real:%d notif:%d]\n" FNORM,
+		    d->n_samples, d->n_real_samples, d->n_notifs);
+		if (sc.idx)
+			frame_index_save(sc.idx, path);
 	}
-
-	msg(FGRN "\tLoaded %d samples [real:%d notif:%d]\n" FNORM,
-	    d->n_samples, d->n_real_samples, d->n_notifs);
+	tal_locked(tal_free(sc.idx));
 	pcap_close(pcap_src);
 
 	return d;
 }
+
+/* Only summaries are kept after all stages which need samples are done. */
+void delay_release_samples(struct delay *d)
+{
+	struct trace *t;
+
+	if (args.scratch) {
+		tal_locked(tal_del_destructor(d, delay_unspill));
+		delay_unspill(d);
+	} else {
+		for_each_trace(d, t) {
+			tal_locked(tal_free(t->samples));
+			t->samples = NULL;
+		}
+	}
+	d->trace_size_ = 0;
+
+	if (d->jit)
+		delay_release_samples(d->jit);
+}
+
+/* Random access to frame pairs of a pcap file mapped into memory.  Result
+ * frames all have the same size, so as long as the DUTs' frames take turns
+ * pair p (a frame from every DUT) is at a fixed offset and any subset can
+ * be decoded without reading the rest of the file.  A frame index, if there
+ * is one, pins every stride-th pair to its real offset.
+ */
+struct frame_map {
+	const u8 *base;
+	size_t size;
+	u32 rec_size; /* pcap record header + frame */
+	u32 n_pairs;
+	s8 key_dut[256];
+
+	struct frame_index *idx; /* to correct for drift, may be NULL */
+};
+
+static void frame_map_unmap(struct frame_map *fm)
+{
+	munmap((void *)fm->base, fm->size);
+}
+
+struct frame_map *frame_map_open(const char *path)
+{
+	struct frame_map *fm;
+	struct stat st;
+	u32 magic, caplen;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return perr_nret("Could not open result file");
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size < PCAP_HDR_LEN + PCAP_REC_HDR) {
+		close(fd);
+		return err_nret("%s is not a pcap file\n", path);
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return perr_nret("Could not map result file");
+
+	fm = tal_locked(talz(NULL, struct frame_map));
+	fm->base = p;
+	fm->size = st.st_size;
+	tal_locked(tal_add_destructor(fm, frame_map_unmap));
+
+	memcpy(&magic, fm->base, sizeof(magic));
+	memcpy(&caplen, fm->base + PCAP_HDR_LEN + 8, sizeof(caplen));
+	if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+		caplen = __builtin_bswap32(caplen);
+	else if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+		goto err_free;
+	if (caplen != sizeof(struct result_frame))
+		goto err_free;
+
+	fm->rec_size = PCAP_REC_HDR + sizeof(struct result_frame);
+	fm->n_pairs = (fm->size - PCAP_HDR_LEN) / fm->rec_size / args.n_duts;
+	key_map_init(fm->key_dut);
+
+	fm->idx = frame_index_load(path);
+	if (fm->idx)
+		tal_locked(tal_steal(fm, fm->idx));
+
+	return fm;
+
+err_free:
+	tal_locked(tal_free(fm));
+	return err_nret("%s is not a capture of result frames\n", path);
+}
+
+u32 frame_map_n_pairs(const struct frame_map *fm)
+{
+	return fm->n_pairs;
+}
+
+/* Hint the kernel whether pairs will be read one after another. */
+void frame_map_stride(const struct frame_map *fm, u32 stride)
+{
+	madvise((void *)fm->base, fm->size,
+		(size_t)stride * args.n_duts * fm->rec_size >
+		2 * (size_t)getpagesize() ?
+		MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+static const struct result_frame *frame_map_fr(const struct frame_map *fm,
+					       u64 rec)
+{
+	const size_t off = PCAP_HDR_LEN + rec * fm->rec_size + PCAP_REC_HDR;
+
+	if (off + sizeof(struct result_frame) > fm->size)
+		return NULL;
+
+	return (const void *)(fm->base + off);
+}
+
+/* Frames from @rec on by DUT into @fr, 1 if they are a pair, 0 if not and
+ * -1 if the file ends before.
+ */
+static int frame_map_group(const struct frame_map *fm, u64 rec,
+			   const struct result_frame **fr)
+{
+	const struct result_frame *f;
+	u32 i, j, seen = 0;
+	int dut;
+
+	for (j = 0; j < args.n_duts; j++) {
+		f = frame_map_fr(fm, rec + j);
+		if (!f)
+			return -1;
+		dut = fm->key_dut[f->key];
+		if (dut < 0 || seen & 1U << dut)
+			return 0;
+		seen |= 1U << dut;
+		fr[dut] = f;
+	}
+
+	for (i = 0; i < FR_N_RES; i++)
+		for (j = 1; j < args.n_duts; j++)
+			if (fr[0]->r[i].tx_ts && fr[j]->r[i].tx_ts &&
+			    fr[0]->r[i].tx_ts != fr[j]->r[i].tx_ts)
+				return 0;
+
+	return 1;
+}
+
+/* Decode samples of pair @p into @out, skipping the same results the full
+ * parser would, bar skips carried over from the previous frame.  Returns
+ * # of samples, -1 if frames at the pair's offset don't make a pair.
+ */
+int frame_map_pair(const struct frame_map *fm, u32 p,
+		   u32 out[FRAME_N_RES][MAX_TRACES])
+{
+	const u32 n_duts = args.n_duts;
+	const struct result_frame *fr[MAX_DUTS];
+	const struct frame_index_ent *e;
+	u32 i, j, n = 0, skip = 0, tx, min, max;
+	u64 rec = (u64)p * n_duts;
+	bool notif;
+	u32 shift;
+	int ret;
+
+	/* with an index count from the last entry's true offset */
+	e = fm->idx ? frame_index_find(fm->idx, p, ~0ULL) : NULL;
+	if (e)
+		rec = (e->offset - PCAP_HDR_LEN) / fm->rec_size +
+			(u64)(p - e->pair) * n_duts;
+
+	/* frames may be off if a DUT's frame got ahead somewhere */
+	for (shift = 0; shift < n_duts; shift++, rec++) {
+		ret = frame_map_group(fm, rec, fr);
+		if (ret < 0)
+			return -1;
+		if (ret)
+			break;
+	}
+	if (shift == n_duts)
+		return -1;
+
+	/* same order of checks as in packet_cb() */
+	for (i = 0; i < FR_N_RES; i++, skip -= !!skip) {
+		notif = false;
+		tx = 0;
+		for (j = 0; j < n_duts; j++) {
+			notif |= !fr[j]->r[i].tx_ts;
+			if (!tx)
+				tx = ntohl(fr[j]->r[i].tx_ts);
+		}
+
+		if (!tx)
+			continue;
+		if ((u64)p * FR_N_RES + i < args.skip_begin)
+			continue;
+		if (notif)
+			skip = args.skip_notif;
+		if (skip)
+			continue;
+
+		min = ~0U;
+		max = 0;
+		for (j = 0; j < n_duts; j++) {
+			out[n][j] = ntohl(fr[j]->r[i].rx_ts) - tx;
+			min = out[n][j] < min ? out[n][j] : min;
+			max = out[n][j] > max ? out[n][j] : max;
+		}
+		out[n][n_duts] = min;
+		out[n][n_duts + 1] = max;
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,67 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Stage graph.  Outputs say which stages they need, the plan is the
+ * closure of that over stage dependencies and only planned stages run.
+ */
+
+#include "mgr_interp.h"
+
+const char *stage_names[STAGE_N] = {
+	"decode", "moments", "distr", "svt", "corr", "evt", "pot", "bootstrap",
+	"pyramid", "pyramid2d", "changes",
+};
+
+static const u32 stage_deps[STAGE_N] = {
+	[STAGE_DECODE]	= 0,
+	[STAGE_MOMENTS]	= STG(DECODE),
+	[STAGE_DISTR]	= STG(DECODE),
+	[STAGE_SVT]	= STG(DECODE),
+	[STAGE_CORR]	= STG(MOMENTS),
+	[STAGE_EVT]	= STG(DECODE),
+	[STAGE_POT]	= STG(DISTR),
+	[STAGE_BOOT]	= STG(EVT),
+	[STAGE_PYR]	= STG(DISTR),
+	[STAGE_PYR2]	= STG(DECODE),
+	[STAGE_CPD]	= STG(SVT),
+};
+
+u32 plan_closure(u32 stages)
+{
+	u32 prev;
+	int s;
+
+	do {
+		prev = stages;
+		for (s = 0; s < STAGE_N; s++)
+			if (stages & 1 << s)
+				stages |= stage_deps[s];
+	} while (stages != prev);
+
+	return stages;
+}
+
+void plan_print(const char *what, u32 stages)
+{
+	int s;
+
+	printf("%s:", what);
+	for (s = 0; s < STAGE_N; s++)
+		if (stages & 1 << s)
+			printf(" %s", stage_names[s]);
+	putchar('\n');
+}
@@ -0,0 +1,316 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Work-stealing task pool.  Every worker has its own deque, it pushes and
+ * pops tasks at the bottom and steals from the top of other workers'
+ * deques when its own runs dry.  Tasks become runnable once all tasks they
+ * were made dependent on (task_after()) are done.  Whoever waits for a
+ * group of tasks (pool_wait()) runs tasks itself in the meantime, so tasks
+ * may wait for sub-tasks without starving the pool.
+ */
+
+#include "mgr_interp.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#define TASK_MAX_SUCC	8
+
+struct task {
+	task_fn fn;
+	void *arg;
+	struct task_group *grp;
+	struct task_log *log;
+
+	u32 n_deps; /* unfinished predecessors + 1 until task_submit() */
+	u32 n_succ;
+	struct task *succ[TASK_MAX_SUCC];
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct task **tasks;
+	u32 size;
+	u32 top;
+	u32 bottom;
+};
+
+static struct pool {
+	u32 n_workers;
+	struct deque *dq;
+	pthread_t *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	u32 n_ready;
+	u32 next_dq; /* round robin for submissions from outside the pool */
+	bool stop;
+} pool;
+
+pthread_mutex_t tal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread FILE *log_out, *log_err;
+static __thread int worker_id = -1;
+
+static void dq_push(struct deque *dq, struct task *t)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom - dq->top == dq->size) {
+		struct task **tasks = malloc(2 * dq->size * sizeof(*tasks));
+		u32 i;
+
+		for (i = dq->top; i != dq->bottom; i++)
+			tasks[i % (2 * dq->size)] = dq->tasks[i % dq->size];
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->size *= 2;
+	}
+	dq->tasks[dq->bottom++ % dq->size] = t;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static struct task *dq_pop(struct deque *dq)
+{
+	struct task *t = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top)
+		t = dq->tasks[--dq->bottom % dq->size];
+	pthread_mutex_unlock(&dq->lock);
+
+	return t;
+}
+
+static struct task *dq_steal(struct deque *dq)
+{
+	struct task *t = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top)
+		t = dq->tasks[dq->top++ % dq->size];
+	pthread_mutex_unlock(&dq->lock);
+
+	return t;
+}
+
+static void pool_wake_all(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void task_ready(struct task *t)
+{
+	u32 i = worker_id;
+
+	if (worker_id < 0)
+		i = __atomic_fetch_add(&pool.next_dq, 1, __ATOMIC_RELAXED);
+
+	dq_push(&pool.dq[i % pool.n_workers], t);
+	__atomic_add_fetch(&pool.n_ready, 1, __ATOMIC_SEQ_CST);
+	pool_wake_all();
+}
+
+static struct task *task_find(void)
+{
+	struct task *t = NULL;
+	u32 i, start;
+
+	if (worker_id >= 0)
+		t = dq_pop(&pool.dq[worker_id]);
+
+	start = worker_id >= 0 ? worker_id : 0;
+	for (i = 1; !t && i <= pool.n_workers; i++)
+		t = dq_steal(&pool.dq[(start + i) % pool.n_workers]);
+
+	if (t)
+		__atomic_sub_fetch(&pool.n_ready, 1, __ATOMIC_SEQ_CST);
+
+	return t;
+}
+
+static void task_run(struct task *t)
+{
+	FILE *prev_out = log_out, *prev_err = log_err;
+	struct task_group *grp = t->grp;
+	u32 i;
+
+	if (t->log) {
+		log_out = open_memstream(&t->log->out, &t->log->out_len);
+		log_err = open_memstream(&t->log->err, &t->log->err_len);
+	}
+
+	t->fn(t->arg);
+
+	if (t->log) {
+		fclose(log_out);
+		fclose(log_err);
+	}
+	log_out = prev_out;
+	log_err = prev_err;
+
+	for (i = 0; i < t->n_succ; i++)
+		if (!__atomic_sub_fetch(&t->succ[i]->n_deps, 1, __ATOMIC_SEQ_CST))
+			task_ready(t->succ[i]);
+	free(t);
+
+	if (grp && !__atomic_sub_fetch(&grp->pending, 1, __ATOMIC_SEQ_CST))
+		pool_wake_all();
+}
+
+static void *pool_worker(void *arg)
+{
+	struct task *t;
+
+	worker_id = (long)arg;
+
+	while (true) {
+		t = task_find();
+		if (t) {
+			task_run(t);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		while (!__atomic_load_n(&pool.n_ready, __ATOMIC_SEQ_CST) &&
+		       !pool.stop)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		if (pool.stop)
+			break;
+	}
+
+	return NULL;
+}
+
+struct task *task_new(task_fn fn, void *arg, struct task_group *grp,
+		      struct task_log *log)
+{
+	struct task *t = calloc(1, sizeof(*t));
+
+	t->fn = fn;
+	t->arg = arg;
+	t->grp = grp;
+	t->log = log;
+	t->n_deps = 1;
+
+	if (grp)
+		__atomic_add_fetch(&grp->pending, 1, __ATOMIC_SEQ_CST);
+
+	return t;
+}
+
+/* Make @t wait for @dep, both must not be submitted yet. */
+void task_after(struct task *t, struct task *dep)
+{
+	assert(dep->n_succ < TASK_MAX_SUCC);
+
+	dep->succ[dep->n_succ++] = t;
+	t->n_deps++;
+}
+
+void task_submit(struct task *t)
+{
+	if (!__atomic_sub_fetch(&t->n_deps, 1, __ATOMIC_SEQ_CST))
+		task_ready(t);
+}
+
+void task_spawn(task_fn fn, void *arg, struct task_group *grp,
+		struct task_log *log)
+{
+	task_submit(task_new(fn, arg, grp, log));
+}
+
+void pool_wait(struct task_group *grp)
+{
+	struct task *t;
+
+	while (__atomic_load_n(&grp->pending, __ATOMIC_SEQ_CST)) {
+		t = task_find();
+		if (t) {
+			task_run(t);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		while (!__atomic_load_n(&pool.n_ready, __ATOMIC_SEQ_CST) &&
+		       __atomic_load_n(&grp->pending, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+u32 pool_size(void)
+{
+	return pool.n_workers;
+}
+
+int pool_init(u32 n_workers)
+{
+	long i;
+
+	pool.n_workers = n_workers;
+	pool.dq = calloc(n_workers, sizeof(*pool.dq));
+	pool.threads = calloc(n_workers, sizeof(*pool.threads));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+
+	for (i = 0; i < n_workers; i++) {
+		pthread_mutex_init(&pool.dq[i].lock, NULL);
+		pool.dq[i].size = 64;
+		pool.dq[i].tasks = malloc(64 * sizeof(*pool.dq[i].tasks));
+	}
+
+	for (i = 0; i < n_workers; i++)
+		if (pthread_create(&pool.threads[i], NULL,
+				   pool_worker, (void *)i))
+			return perr_ret("Could not start worker thread");
+
+	return 0;
+}
+
+void pool_fini(void)
+{
+	u32 i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.n_workers; i++) {
+		pthread_join(pool.threads[i], NULL);
+		free(pool.dq[i].tasks);
+	}
+	free(pool.dq);
+	free(pool.threads);
+}
+
+/* Dump and free the buffered output of a task. */
+void task_log_flush(struct task_log *log)
+{
+	if (log->out)
+		fwrite(log->out, 1, log->out_len, stdout);
+	if (log->err)
+		fwrite(log->err, 1, log->err_len, stderr);
+	free(log->out);
+	free(log->err);
+	memset(log, 0, sizeof(*log));
+}
@@ -0,0 +1,271 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Peaks-over-threshold tail estimation.  Generalised Pareto distribution
+ * is fitted to all samples above a high threshold, which is taken straight
+ * from the trace histogram (t->distr), so no sample is looked at twice.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+/* Threshold candidates are quantiles in [POT_Q_MIN, POT_Q_MAX] */
+#define POT_N_CAND	24
+#define POT_Q_MIN	0.80
+#define POT_Q_MAX	0.995
+#define POT_MIN_EXC	50
+/* Max deviation of mean excess from a line, in standard errors */
+#define POT_ME_TOL	2.0
+
+#define POT_GRID	128
+#define POT_GOLDEN_ITER	64
+
+struct pot_cand {
+	u32 idx; /* first distr entry above the threshold */
+	double u;
+	u64 n_exc;
+	double me; /* mean excess */
+};
+
+/* Exceedances are integer clock values, put the threshold half way
+ * between the last value below and the first one above it.
+ */
+static inline double pot_u(const struct distribution *distr, u32 idx)
+{
+	return distr[idx].val - 0.5;
+}
+
+/* GPD profile log-likelihood in theta = xi/sigma (Grimshaw), returns xi
+ * for given theta via @xi_.
+ */
+static double gpd_profile(const struct distribution *distr, u32 n,
+			  double u, u64 n_exc, double theta, double *xi_)
+{
+	u32 i;
+	double sum = 0, y_sum = 0, xi;
+
+	if (fabs(theta) < 1e-12) {
+		for (i = 0; i < n; i++)
+			y_sum += distr[i].cnt * (distr[i].val - u);
+		*xi_ = 0;
+
+		return -(double)n_exc * (log(y_sum / n_exc) + 1);
+	}
+
+	for (i = 0; i < n; i++)
+		sum += distr[i].cnt * log1p(theta * (distr[i].val - u));
+	xi = sum / n_exc;
+	*xi_ = xi;
+
+	if (xi / theta <= 0)
+		return -INFINITY;
+
+	return -(double)n_exc * (log(xi / theta) + xi + 1);
+}
+
+static bool gpd_fit(struct pot_distr *pot, const struct distribution *distr,
+		    u32 n)
+{
+	const double ymax = distr[n - 1].val - pot->u;
+	double y_mean = 0, lo, hi, best_llh, llh, xi, theta, best_theta;
+	double a, b, c1, c2, l1, l2;
+	u32 i;
+
+	for (i = 0; i < n; i++)
+		y_mean += distr[i].cnt * (distr[i].val - pot->u);
+	y_mean /= pot->n_exc;
+
+	/* theta * y_mean is dimensionless, search over that */
+	lo = -y_mean / ymax * (1 - 1e-6);
+	hi = 32;
+
+	best_theta = 0;
+	best_llh = gpd_profile(distr, n, pot->u, pot->n_exc, 0, &xi);
+	for (i = 0; i <= POT_GRID; i++) {
+		theta = (lo + (hi - lo) * i / POT_GRID) / y_mean;
+		llh = gpd_profile(distr, n, pot->u, pot->n_exc, theta, &xi);
+		if (llh > best_llh) {
+			best_llh = llh;
+			best_theta = theta;
+		}
+	}
+
+	/* golden section refine within one grid step around the best */
+	a = best_theta - (hi - lo) / POT_GRID / y_mean;
+	b = best_theta + (hi - lo) / POT_GRID / y_mean;
+	if (a < lo / y_mean)
+		a = lo / y_mean;
+	for (i = 0; i < POT_GOLDEN_ITER; i++) {
+		c1 = b - (b - a) * 0.6180339887;
+		c2 = a + (b - a) * 0.6180339887;
+		l1 = gpd_profile(distr, n, pot->u, pot->n_exc, c1, &xi);
+		l2 = gpd_profile(distr, n, pot->u, pot->n_exc, c2, &xi);
+		if (l1 > l2)
+			b = c2;
+		else
+			a = c1;
+	}
+	theta = (a + b) / 2;
+	llh = gpd_profile(distr, n, pot->u, pot->n_exc, theta, &xi);
+	if (llh < best_llh) {
+		theta = best_theta;
+		llh = gpd_profile(distr, n, pot->u, pot->n_exc, theta, &xi);
+	}
+
+	if (!isfinite(llh))
+		return false;
+
+	pot->xi = xi;
+	pot->sigma = fabs(theta) < 1e-12 ? y_mean : xi / theta;
+	pot->llh = llh;
+
+	return pot->sigma > 0;
+}
+
+/* Pick the lowest threshold above which the mean excess is linear in u,
+ * as it should be if the exceedances are GPD.  Weighted LSQ line is fitted
+ * to the candidates above each threshold in turn.
+ */
+static u32 pot_pick_threshold(const struct pot_cand *cand, u32 n_cand)
+{
+	u32 k, j;
+	double w, sw, swu, swe, swuu, swue, slope, icpt, dev, max_dev;
+
+	for (k = 0; k + 3 <= n_cand; k++) {
+		sw = swu = swe = swuu = swue = 0;
+		for (j = k; j < n_cand; j++) {
+			w = cand[j].n_exc / (cand[j].me * cand[j].me);
+			sw += w;
+			swu += w * cand[j].u;
+			swe += w * cand[j].me;
+			swuu += w * cand[j].u * cand[j].u;
+			swue += w * cand[j].u * cand[j].me;
+		}
+		slope = (sw * swue - swu * swe) / (sw * swuu - swu * swu);
+		icpt = (swe - slope * swu) / sw;
+
+		max_dev = 0;
+		for (j = k; j < n_cand; j++) {
+			dev = fabs(cand[j].me - (icpt + slope * cand[j].u)) /
+				(cand[j].me / sqrt(cand[j].n_exc));
+			if (dev > max_dev)
+				max_dev = dev;
+		}
+		dbg("POT cand %u u=%.1lf me=%.3lf dev=%.3lf\n",
+		    k, cand[k].u, cand[k].me, max_dev);
+
+		if (max_dev <= POT_ME_TOL)
+			return k;
+	}
+
+	return n_cand > 3 ? n_cand - 3 : 0;
+}
+
+/* Value exceeded by a single sample with probability @p. */
+double pot_xceed(const struct trace *t, double p)
+{
+	const struct pot_distr *pot = &t->pot;
+	const double zeta = (double)pot->n_exc / t->d->n_samples;
+	u64 above = 0;
+	int i;
+
+	/* Not in the tail, just read the histogram. */
+	if (p >= zeta) {
+		for (i = tal_count(t->distr) - 1; i >= 0; i--) {
+			above += t->distr[i].cnt;
+			if (above > p * t->d->n_samples)
+				return t->distr[i].val;
+		}
+		return t->min;
+	}
+
+	if (fabs(pot->xi) < 1e-12)
+		return pot->u + pot->sigma * log(zeta / p);
+
+	return pot->u + pot->sigma / pot->xi * (pow(p / zeta, -pot->xi) - 1);
+}
+
+void calc_pot(struct trace *t, u32 n_samples)
+{
+	const struct distribution *distr = t->distr;
+	const u32 n = tal_count(distr);
+	struct pot_cand cand[POT_N_CAND];
+	u32 n_cand = 0, k, i;
+	u64 *tail_cnt;
+	double *tail_sum;
+	double q;
+
+	memset(&t->pot, 0, sizeof(t->pot));
+	if (n < 2)
+		return;
+
+	/* suffix sums: count and sum of values at and above distr[i] */
+	tail_cnt = malloc((n + 1) * sizeof(*tail_cnt));
+	tail_sum = malloc((n + 1) * sizeof(*tail_sum));
+	tail_cnt[n] = 0;
+	tail_sum[n] = 0;
+	for (i = n; i > 0; i--) {
+		tail_cnt[i-1] = tail_cnt[i] + distr[i-1].cnt;
+		tail_sum[i-1] = tail_sum[i] +
+			(double)distr[i-1].cnt * distr[i-1].val;
+	}
+
+	for (k = 0, i = 0; k < POT_N_CAND; k++) {
+		q = POT_Q_MIN + (POT_Q_MAX - POT_Q_MIN) * k / (POT_N_CAND - 1);
+
+		/* first value with more than q of the samples below it */
+		while (i < n && n_samples - tail_cnt[i] < q * n_samples)
+			i++;
+		if (!i || i >= n || tail_cnt[i] < POT_MIN_EXC)
+			break;
+		if (n_cand && cand[n_cand - 1].idx == i)
+			continue;
+
+		cand[n_cand].idx = i;
+		cand[n_cand].u = pot_u(distr, i);
+		cand[n_cand].n_exc = tail_cnt[i];
+		cand[n_cand].me = tail_sum[i] / tail_cnt[i] - cand[n_cand].u;
+		n_cand++;
+	}
+
+	if (!n_cand) {
+		err("\t\tPOT: not enough exceedances\n");
+		goto out;
+	}
+
+	k = pot_pick_threshold(cand, n_cand);
+
+	t->pot.u = cand[k].u;
+	t->pot.n_exc = cand[k].n_exc;
+	t->pot.ok = gpd_fit(&t->pot, &distr[cand[k].idx], n - cand[k].idx);
+	if (!t->pot.ok) {
+		err("\t\tPOT: failed to fit GPD\n");
+		goto out;
+	}
+
+	t->pot.xceed = pot_xceed(t, 0.0001);
+	msg("\t\tPOT u=%.1lf (%u exc, %u cand): sigma=%.4lf xi=%.4lf  %lg\n",
+	    t->pot.u, t->pot.n_exc, n_cand, t->pot.sigma, t->pot.xi,
+	    t->pot.xceed);
+out:
+	free(tail_cnt);
+	free(tail_sum);
+}
@@ -0,0 +1,203 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Sampled preview.  Every k-th frame pair is decoded straight from the
+ * mapped file and approximate stats are printed with 95% error bounds.
+ * Pairs are treated as clusters of correlated samples: the error of the
+ * mean comes from the spread of per-pair means, percentile bounds from
+ * the binomial error of the empirical CDF with # of pairs as sample size,
+ * both with finite population correction.  With --refine the stride is
+ * halved until every pair is in, at which point the bounds are zero.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define PREVIEW_Z	1.96
+
+struct preview_trace {
+	u32 *samples;
+	u32 n;
+
+	double sum;
+	double sq;
+	double pair_sum; /* of per-pair means */
+	double pair_sq;
+};
+
+struct preview {
+	struct frame_map *fm;
+	u32 n_pairs; /* total in file */
+	u32 n_done; /* decoded */
+	u32 n_used; /* decoded with samples, units of the mean's bound */
+	u32 n_bad;
+
+	u32 strides[32];
+	u32 n_strides;
+
+	struct preview_trace t[MAX_TRACES];
+};
+
+static int cmp_u32(const void *a1, const void *a2)
+{
+	const u32 *a = a1, *b = a2;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+static bool preview_seen(const struct preview *pv, u32 p)
+{
+	u32 i;
+
+	for (i = 0; i < pv->n_strides; i++)
+		if (!(p % pv->strides[i]))
+			return true;
+
+	return false;
+}
+
+static void preview_round(struct preview *pv, u32 stride)
+{
+	u32 out[FRAME_N_RES][MAX_TRACES];
+	struct preview_trace *pt;
+	double pair_sum;
+	u32 p, i, j;
+	int n;
+
+	frame_map_stride(pv->fm, stride);
+
+	for (p = 0; p < pv->n_pairs; p += stride) {
+		if (preview_seen(pv, p))
+			continue;
+
+		n = frame_map_pair(pv->fm, p, out);
+		if (n < 0) {
+			pv->n_bad++;
+			continue;
+		}
+		pv->n_done++;
+		if (!n)
+			continue;
+		pv->n_used++;
+
+		for (j = 0; j < args.n_traces; j++) {
+			pt = &pv->t[j];
+			if (tal_count(pt->samples) < pt->n + n)
+				tal_resize(&pt->samples, (pt->n + n) * 2);
+
+			pair_sum = 0;
+			for (i = 0; i < (u32)n; i++) {
+				pt->samples[pt->n++] = out[i][j];
+				pt->sum += out[i][j];
+				pt->sq += (double)out[i][j] * out[i][j];
+				pair_sum += out[i][j];
+			}
+			pt->pair_sum += pair_sum / n;
+			pt->pair_sq += pair_sum / n * pair_sum / n;
+		}
+	}
+
+	pv->strides[pv->n_strides++] = stride;
+}
+
+static u32 preview_quantile(const struct preview_trace *pt, double q)
+{
+	if (q <= 0)
+		return pt->samples[0];
+	if (q >= 1)
+		return pt->samples[pt->n - 1];
+
+	return pt->samples[(u32)(q * (pt->n - 1) + 0.5)];
+}
+
+static void preview_print(struct preview *pv, const char *fname, u32 stride)
+{
+	static const double pcts[] = { 50, 99, 99.9 };
+	const u32 f = pv->n_done, u = pv->n_used;
+	const double fpc = pv->n_pairs ? 1 - (double)f / pv->n_pairs : 0;
+	struct preview_trace *pt;
+	double mean, var, h, q;
+	u32 i, j;
+
+	msg(FBOLD "Preview %s 1/%u" FNORM " [%u/%u pairs%s]\n", fname, stride,
+	    f, pv->n_pairs, fpc > 0 ? "" : ", all");
+	if (pv->n_bad)
+		msg(FYLW "\t%u pairs not at their offset, skipped\n" FNORM,
+		    pv->n_bad);
+
+	for (j = 0; j < args.n_traces; j++) {
+		pt = &pv->t[j];
+		if (pt->n < 2 || u < 2)
+			continue;
+
+		qsort(pt->samples, pt->n, sizeof(*pt->samples), cmp_u32);
+
+		mean = pt->sum / pt->n;
+		var = (pt->pair_sq - pt->pair_sum * pt->pair_sum / u) / (u - 1);
+		msg("\tTrace %d: mean %lf +-%lf stdev %lf max >=%u\n", j,
+		    mean, PREVIEW_Z * sqrt(fpc * var / u),
+		    sqrt((pt->sq - pt->sum * mean) / (pt->n - 1)),
+		    pt->samples[pt->n - 1]);
+
+		msg("\t\tpercentiles:");
+		for (i = 0; i < sizeof(pcts)/sizeof(pcts[0]); i++) {
+			q = pcts[i] / 100;
+			h = PREVIEW_Z * sqrt(fpc * q * (1 - q) / u);
+			msg(" p%lg %u [%u, %u]", pcts[i],
+			    preview_quantile(pt, q),
+			    preview_quantile(pt, q - h),
+			    preview_quantile(pt, q + h));
+		}
+		msg("\n");
+	}
+	fflush(stdout);
+}
+
+int preview_file(const char *path, u32 stride, bool refine)
+{
+	const char *fname = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	struct preview *pv;
+	int i;
+
+	pv = talz(NULL, struct preview);
+	pv->fm = frame_map_open(path);
+	if (!pv->fm) {
+		tal_free(pv);
+		return 1;
+	}
+	tal_steal(pv, pv->fm);
+	pv->n_pairs = frame_map_n_pairs(pv->fm);
+	for (i = 0; i < (int)args.n_traces; i++)
+		pv->t[i].samples = tal_arr(pv, u32, 0);
+
+	while (true) {
+		preview_round(pv, stride);
+		preview_print(pv, fname, stride);
+
+		if (!refine || stride == 1)
+			break;
+		stride /= 2;
+	}
+
+	tal_free(pv);
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Power-of-two resolution pyramids of the trace histograms and of the
+ * t0 x t1 joint histogram.  Level k holds counts of aligned bins 2^k wide,
+ * so the count over any value range is a sum of O(log range) bins and any
+ * bucket size or zoom window is served without touching the samples.  The
+ * joint pyramid keeps every combination of x and y levels, ~4x the size of
+ * the full resolution table.
+ */
+
+#include "mgr_interp.h"
+
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define PYR_MAX_LEN	(1U << (PYR_MAX_LEVELS - 1))
+#define PYR2_MAX_CELLS	(1U << 24)
+
+/* Split [lo, hi) into aligned power-of-two bins, returns # of bins. */
+static u32 pyr_split(u32 lo, u32 hi, u32 n_levels, u8 *lvl, u32 *idx)
+{
+	u32 n = 0, k;
+
+	while (lo < hi) {
+		for (k = n_levels - 1; k; k--)
+			if (!(lo & ((1U << k) - 1)) && hi - lo >= 1U << k)
+				break;
+		lvl[n] = k;
+		idx[n] = lo >> k;
+		n++;
+		lo += 1U << k;
+	}
+
+	return n;
+}
+
+static u32 pyr_n_levels(u32 len)
+{
+	u32 n = 1;
+
+	while (1U << (n - 1) < len)
+		n++;
+
+	return n;
+}
+
+void calc_pyramid(struct trace *t)
+{
+	const u32 n_distinct = tal_count(t->distr);
+	struct pyramid *p;
+	u64 len;
+	u32 i, k;
+
+	len = n_distinct ? t->distr[n_distinct - 1].val - t->distr[0].val + 1 : 0;
+	if (len > PYR_MAX_LEN) {
+		msg(FYLW "\tTrace %d: range too wide for a pyramid\n" FNORM,
+		    (int)(t - t->d->t));
+		return;
+	}
+
+	p = tal_locked(talz(t->d, struct pyramid));
+	p->base = n_distinct ? t->distr[0].val : 0;
+	p->n_levels = pyr_n_levels(len);
+
+	p->len[0] = len;
+	p->lvl[0] = tal_locked(tal_arrz(p, u32, p->len[0]));
+	for (i = 0; i < n_distinct; i++)
+		p->lvl[0][t->distr[i].val - p->base] = t->distr[i].cnt;
+
+	for (k = 1; k < p->n_levels; k++) {
+		p->len[k] = (p->len[k - 1] + 1) / 2;
+		p->lvl[k] = tal_locked(tal_arrz(p, u32, p->len[k]));
+		for (i = 0; i < p->len[k - 1]; i++)
+			p->lvl[k][i / 2] += p->lvl[k - 1][i];
+	}
+
+	t->pyr = p;
+}
+
+/* # of samples with values in [lo, hi) */
+u64 pyramid_sum(const struct pyramid *p, u32 lo, u32 hi)
+{
+	u8 lvl[2 * PYR_MAX_LEVELS];
+	u32 idx[2 * PYR_MAX_LEVELS], n, i;
+	u64 sum = 0;
+
+	if (lo < p->base)
+		lo = p->base;
+	if (hi > p->base + p->len[0])
+		hi = p->base + p->len[0];
+	if (lo >= hi)
+		return 0;
+
+	n = pyr_split(lo - p->base, hi - p->base, p->n_levels, lvl, idx);
+	for (i = 0; i < n; i++)
+		sum += p->lvl[lvl[i]][idx[i]];
+
+	return sum;
+}
+
+#define PYR2(_p_, _kx_, _ky_)	((_p_)->lvl[(_kx_) * PYR_MAX_LEVELS + (_ky_)])
+
+void calc_pyramid2(struct delay *d)
+{
+	const struct trace *tx = &d->t[0], *ty = &d->t[1];
+	struct pyramid2 *p;
+	u32 kx, ky, i, j, *src, *dst;
+
+	if (!d->n_samples)
+		return;
+	if ((u64)(tx->max - tx->min + 1) * (ty->max - ty->min + 1) >
+	    PYR2_MAX_CELLS) {
+		msg(FYLW "\tJoint range too wide for a pyramid\n" FNORM);
+		return;
+	}
+
+	p = tal_locked(talz(d, struct pyramid2));
+	p->base[0] = tx->min;
+	p->base[1] = ty->min;
+	p->n_levels[0] = pyr_n_levels(tx->max - tx->min + 1);
+	p->n_levels[1] = pyr_n_levels(ty->max - ty->min + 1);
+
+	p->dim[0][0] = tx->max - tx->min + 1;
+	for (kx = 1; kx < p->n_levels[0]; kx++)
+		p->dim[0][kx] = (p->dim[0][kx - 1] + 1) / 2;
+	p->dim[1][0] = ty->max - ty->min + 1;
+	for (ky = 1; ky < p->n_levels[1]; ky++)
+		p->dim[1][ky] = (p->dim[1][ky - 1] + 1) / 2;
+
+	for (kx = 0; kx < p->n_levels[0]; kx++)
+		for (ky = 0; ky < p->n_levels[1]; ky++)
+			PYR2(p, kx, ky) =
+				tal_locked(tal_arrz(p, u32, (size_t)p->dim[0][kx] *
+						    p->dim[1][ky]));
+
+	dst = PYR2(p, 0, 0);
+	for (i = 0; i < d->n_samples; i++)
+		dst[(size_t)(tx->samples[i] - p->base[0]) * p->dim[1][0] +
+		    ty->samples[i] - p->base[1]]++;
+
+	for (kx = 0; kx < p->n_levels[0]; kx++)
+		for (ky = 0; ky < p->n_levels[1]; ky++) {
+			if (!kx && !ky)
+				continue;
+
+			dst = PYR2(p, kx, ky);
+			if (ky) {
+				/* pair up columns of (kx, ky - 1) */
+				src = PYR2(p, kx, ky - 1);
+				for (i = 0; i < p->dim[0][kx]; i++)
+					for (j = 0; j < p->dim[1][ky - 1]; j++)
+						dst[(size_t)i * p->dim[1][ky] + j / 2] +=
+							src[(size_t)i * p->dim[1][ky - 1] + j];
+			} else {
+				/* pair up rows of (kx - 1, 0) */
+				src = PYR2(p, kx - 1, 0);
+				for (i = 0; i < p->dim[0][kx - 1]; i++)
+					for (j = 0; j < p->dim[1][0]; j++)
+						dst[(size_t)(i / 2) * p->dim[1][0] + j] +=
+							src[(size_t)i * p->dim[1][0] + j];
+			}
+		}
+
+	d->pyr2 = p;
+}
+
+/* # of samples with t0 in [x0, x1) and t1 in [y0, y1) */
+u64 pyramid2_sum(const struct pyramid2 *p, u32 x0, u32 x1, u32 y0, u32 y1)
+{
+	u8 lx[2 * PYR_MAX_LEVELS], ly[2 * PYR_MAX_LEVELS];
+	u32 ix[2 * PYR_MAX_LEVELS], iy[2 * PYR_MAX_LEVELS], nx, ny, i, j;
+	u64 sum = 0;
+
+	if (x0 < p->base[0])
+		x0 = p->base[0];
+	if (x1 > p->base[0] + p->dim[0][0])
+		x1 = p->base[0] + p->dim[0][0];
+	if (y0 < p->base[1])
+		y0 = p->base[1];
+	if (y1 > p->base[1] + p->dim[1][0])
+		y1 = p->base[1] + p->dim[1][0];
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	nx = pyr_split(x0 - p->base[0], x1 - p->base[0], p->n_levels[0],
+		       lx, ix);
+	ny = pyr_split(y0 - p->base[1], y1 - p->base[1], p->n_levels[1],
+		       ly, iy);
+
+	for (i = 0; i < nx; i++)
+		for (j = 0; j < ny; j++)
+			sum += PYR2(p, lx[i], ly[j])
+				[(size_t)ix[i] * p->dim[1][ly[j]] + iy[j]];
+
+	return sum;
+}
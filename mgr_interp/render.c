@@ -0,0 +1,184 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Heatmap images.  Samples are binned straight into a pixel-sized
+ * histogram, t1 along x and t0 along y growing upwards, the same layout
+ * mgr_hm.plg gives the text matrix.  Counts are coloured on a log scale
+ * with gnuplot's default palette (rgbformulae 7,5,15), empty pixels are
+ * black.  PNG needs libpng at build time, PPM and PGM are always there.
+ */
+
+#include "mgr_interp.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+#include <ccan/tal/str/str.h>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+const char *img_format_names[] = {
+	"png", "ppm", "pgm",
+};
+
+static u8 palette_val(double v)
+{
+	if (v <= 0)
+		return 0;
+	if (v >= 1)
+		return 255;
+	return v * 255 + 0.5;
+}
+
+static void palette(double v, u8 *px)
+{
+	px[0] = palette_val(sqrt(v));
+	px[1] = palette_val(v * v * v);
+	px[2] = palette_val(sin(2 * M_PI * v));
+}
+
+static u32 *bin_samples(const struct delay *d, const u32 lo[2],
+			const u32 hi[2], u32 w, u32 h)
+{
+	const u64 span[2] = { (u64)hi[0] - lo[0] + 1, (u64)hi[1] - lo[1] + 1 };
+	u32 *cnt, i, x, y, v0, v1;
+
+	cnt = tal_locked(tal_arrz(NULL, u32, (size_t)w * h));
+
+	for (i = 0; i < d->n_samples; i++) {
+		v0 = d->t[0].samples[i];
+		v1 = d->t[1].samples[i];
+		if (v0 < lo[0] || v0 > hi[0] || v1 < lo[1] || v1 > hi[1])
+			continue;
+
+		x = (v1 - lo[1]) * (u64)w / span[1];
+		y = h - 1 - (v0 - lo[0]) * (u64)h / span[0];
+		cnt[(size_t)y * w + x]++;
+	}
+
+	return cnt;
+}
+
+static int write_pnm(FILE *f, const u8 *img, u32 w, u32 h, u32 ch)
+{
+	fprintf(f, "P%c\n%u %u\n255\n", ch == 1 ? '5' : '6', w, h);
+	if (fwrite(img, (size_t)w * ch, h, f) != h)
+		return err_ret("Writing image failed\n");
+
+	return 0;
+}
+
+#ifdef HAVE_LIBPNG
+static int write_png(FILE *f, const u8 *img, u32 w, u32 h)
+{
+	png_structp png;
+	png_infop info;
+	u32 y;
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return err_ret("Could not init libpng\n");
+	info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_write_struct(&png, NULL);
+		return err_ret("Could not init libpng\n");
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		return err_ret("Writing image failed\n");
+	}
+
+	png_init_io(png, f);
+	/* heatmaps are mostly flat colour, speed beats the last few % */
+	png_set_compression_level(png, 3);
+	png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB,
+		     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		     PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	for (y = 0; y < h; y++)
+		png_write_row(png, (png_const_bytep)(img + (size_t)y * w * 3));
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+
+	return 0;
+}
+#endif
+
+/* Render t0 x t1 of @d into <dir>/<fname>.<fmt>, clipped to --img-range. */
+int render_hm(const struct delay *d, const char *dir)
+{
+	const u32 w = args.img_w, h = args.img_h;
+	const u32 ch = args.img_format == IMG_PGM ? 1 : 3;
+	u32 lo[2], hi[2], *cnt, max = 0;
+	size_t i, n = (size_t)w * h;
+	double scale;
+	char *path;
+	u8 *img;
+	FILE *f;
+	int ret;
+
+	if (!d->n_samples)
+		return 0;
+
+	lo[0] = d->t[0].min > args.img_range[0] ? d->t[0].min : args.img_range[0];
+	hi[0] = d->t[0].max < args.img_range[1] ? d->t[0].max : args.img_range[1];
+	lo[1] = d->t[1].min > args.img_range[2] ? d->t[1].min : args.img_range[2];
+	hi[1] = d->t[1].max < args.img_range[3] ? d->t[1].max : args.img_range[3];
+	if (lo[0] > hi[0] || lo[1] > hi[1])
+		return 0;
+
+	cnt = bin_samples(d, lo, hi, w, h);
+	for (i = 0; i < n; i++)
+		if (cnt[i] > max)
+			max = cnt[i];
+	scale = max ? 1 / log1p(max) : 0;
+
+	img = tal_locked(tal_arr(NULL, u8, n * ch));
+	for (i = 0; i < n; i++) {
+		double v = log1p(cnt[i]) * scale;
+
+		if (ch == 1)
+			img[i] = palette_val(v);
+		else
+			palette(v, &img[i * 3]);
+	}
+	tal_locked(tal_free(cnt));
+
+	path = tal_locked(tal_fmt(NULL, "%s/%s.%s", dir, d->fname,
+				  img_format_names[args.img_format]));
+	f = fopen(path, "w");
+	tal_locked(tal_free(path));
+	if (!f) {
+		tal_locked(tal_free(img));
+		return perr_ret("Opening image file to write failed");
+	}
+
+#ifdef HAVE_LIBPNG
+	if (args.img_format == IMG_PNG)
+		ret = write_png(f, img, w, h);
+	else
+#endif
+		ret = write_pnm(f, img, w, h, ch);
+	if (fclose(f))
+		ret = perr_ret("Writing image failed");
+	tal_locked(tal_free(img));
+
+	return ret;
+}
@@ -0,0 +1,338 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Query daemon.  The bank stays in memory and clients connected to a Unix
+ * socket ask for results one line at a time:
+ *
+ *   list
+ *   distr <file> <bucket> [<from> <to>]
+ *   svt <file> <block>
+ *   hm <file> <aggregation> [<t0 from> <t0 to> <t1 from> <t1 to>]
+ *   pct <file> <trace> <percentile>
+ *   events <file> <type> [<from> <to> [<above>]]
+ *   bad <file> <trace> <gap> [<from> <to>]
+ *
+ * <file> is a name or an index from list, optional ranges zoom in on
+ * values, inclusive, for events and bad periods they are result #s.
+ * Those two are answered from the event index, see --xceed, exceedances
+ * of trace <n> are events of type xceed<n>.  Histograms are summed from
+ * the pyramids so any bucket size and zoom costs about the same.
+ * Every response is terminated with an empty line, errors are a single
+ * "ERR <reason>" line.  Each client gets its own thread, the bank is only
+ * read.
+ */
+
+#include "mgr_interp.h"
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <ccan/tal/tal.h>
+
+struct client {
+	const struct delay_bank *db;
+	int fd;
+};
+
+static const struct delay *serve_find(const struct delay_bank *db,
+				      const char *key)
+{
+	char *end;
+	long idx;
+	int i;
+
+	idx = strtol(key, &end, 10);
+	if (!*end && idx >= 0 && idx < db->n)
+		return db->bank[idx];
+
+	for (i = 0; i < db->n; i++)
+		if (!strcmp(db->bank[i]->fname, key))
+			return db->bank[i];
+
+	return NULL;
+}
+
+static void serve_list(const struct delay_bank *db, FILE *f)
+{
+	const struct delay *d;
+	int i;
+
+	for (i = 0; i < db->n; i++) {
+		d = db->bank[i];
+		fprintf(f, "%d %s %u %lf %lf %lf %lf\n", i, d->fname,
+			d->n_samples, d->t[0].mean, d->t[0].stdev,
+			d->t[1].mean, d->t[1].stdev);
+	}
+}
+
+/* Stats vs time for arbitrary block sizes, same columns as --stats-time-dir */
+static void serve_svt(const struct delay *d, u32 block, FILE *f)
+{
+	double sum[MAX_TRACES], sq[MAX_TRACES], co, mean[MAX_TRACES];
+	u32 min[MAX_TRACES], max[MAX_TRACES];
+	u32 b, i, j, x;
+
+	for (b = 0; b < d->n_samples / block; b++) {
+		const u32 base = b * block;
+
+		for (j = 0; j < d->n_traces; j++) {
+			min[j] = -1;
+			max[j] = 0;
+			sum[j] = 0;
+			for (i = base; i < base + block; i++) {
+				x = d->t[j].samples[i];
+				sum[j] += x;
+				if (x < min[j])
+					min[j] = x;
+				if (x > max[j])
+					max[j] = x;
+			}
+			mean[j] = sum[j] / block;
+		}
+
+		co = 0;
+		for (j = 0; j < d->n_traces; j++)
+			sq[j] = 0;
+		for (i = base; i < base + block; i++) {
+			for (j = 0; j < d->n_traces; j++)
+				sq[j] += (d->t[j].samples[i] - mean[j]) *
+					(d->t[j].samples[i] - mean[j]);
+			co += (d->t[0].samples[i] - mean[0]) *
+				(d->t[1].samples[i] - mean[1]);
+		}
+
+		for (j = 0; j < d->n_traces; j++)
+			fprintf(f, "%u %u %le %le ", min[j], max[j], mean[j],
+				sqrt(sq[j] / (block - 1)));
+		fprintf(f, "%le\n", co / (sqrt(sq[0]) * sqrt(sq[1])));
+	}
+}
+
+static int serve_pct(const struct delay *d, u32 tr, double p, FILE *f)
+{
+	const struct distribution *distr = d->t[tr].distr;
+	u64 acc = 0;
+	u32 i;
+
+	for (i = 0; i < tal_count(distr); i++) {
+		acc += distr[i].cnt;
+		if (acc >= p / 100 * d->n_samples)
+			break;
+	}
+	if (i == tal_count(distr))
+		return 1;
+
+	fprintf(f, "%u\n", distr[i].val);
+
+	return 0;
+}
+
+/* "result sample value" of events of one type, @above filters values */
+static int serve_events(const struct delay *d, const char *line, FILE *f)
+{
+	u32 win[2] = { 0, ~0U }, above = 0, i, n;
+	const struct event *ev;
+	char name[16];
+	int type, cnt;
+
+	cnt = sscanf(line, "%*s %*s %15s %u %u %u", name, &win[0], &win[1],
+		     &above);
+	if (cnt < 1 || cnt == 2)
+		return 1;
+	for (type = 0; type < EV_N; type++)
+		if (!strcmp(name, event_names[type]))
+			break;
+	if (type == EV_N)
+		return 1;
+
+	n = event_count(d, type);
+	for (i = event_lower_bound(d, type, win[0]); i < n; i++) {
+		ev = &d->events->ev[type][i];
+		if (ev->res > win[1])
+			break;
+		if (type >= EV_XCEED0 && ev->val <= above)
+			continue;
+
+		fprintf(f, "%u %u %d\n", ev->res, ev->sample, ev->val);
+	}
+
+	return 0;
+}
+
+static void serve_request(const struct delay_bank *db, char *line, FILE *f)
+{
+	const struct delay *d = NULL;
+	char cmd[16], key[256];
+	u32 win[4] = { 0, ~0U, 0, ~0U };
+	struct wbuf w;
+	double p;
+	u32 n;
+	int cnt, n_win;
+
+	cnt = sscanf(line, "%15s %255s %u", cmd, key, &n);
+	if (cnt < 1) {
+		fprintf(f, "ERR empty request\n");
+		return;
+	}
+
+	if (!strcmp(cmd, "list")) {
+		serve_list(db, f);
+		goto out;
+	}
+
+	if (strcmp(cmd, "distr") && strcmp(cmd, "svt") &&
+	    strcmp(cmd, "hm") && strcmp(cmd, "pct") &&
+	    strcmp(cmd, "events") && strcmp(cmd, "bad")) {
+		fprintf(f, "ERR bad request\n");
+		return;
+	}
+	if (cnt < 3 && (strcmp(cmd, "events") || cnt < 2)) {
+		fprintf(f, "ERR usage: %s <file> <n>\n", cmd);
+		return;
+	}
+	d = serve_find(db, key);
+	if (!d) {
+		fprintf(f, "ERR no such file %s\n", key);
+		return;
+	}
+
+	n_win = sscanf(line, "%*s %*s %*u %u %u %u %u",
+		       &win[0], &win[1], &win[2], &win[3]);
+
+	if (!strcmp(cmd, "events")) {
+		if (serve_events(d, line, f)) {
+			fprintf(f, "ERR usage: events <file> <type> [<from> <to> [<above>]]\n");
+			return;
+		}
+	} else if (!strcmp(cmd, "bad") && n < d->n_traces && n_win >= 1 &&
+		   n_win != 2) {
+		if (!wb_open(&w, f, FMT_TEXT)) {
+			write_bad_periods(d, n, win[0],
+					  n_win == 3 ? win[1] : 0,
+					  n_win == 3 ? win[2] : ~0U, &w);
+			wb_close(&w);
+		}
+	} else if (!strcmp(cmd, "distr") && n && (n_win <= 0 || n_win == 2)) {
+		if (!wb_open(&w, f, FMT_TEXT)) {
+			write_distr(d, &w, n, win[0], win[1]);
+			wb_close(&w);
+		}
+	} else if (!strcmp(cmd, "svt") && n > 1) {
+		serve_svt(d, n, f);
+	} else if (!strcmp(cmd, "hm") && n && (n_win <= 0 || n_win == 4)) {
+		if (!wb_open(&w, f, FMT_TEXT)) {
+			write_hm(d, &w, n, win[0], win[1], win[2], win[3]);
+			wb_close(&w);
+		}
+	} else if (!strcmp(cmd, "pct")) {
+		if (n >= d->n_traces ||
+		    sscanf(line, "%*s %*s %*u %lf", &p) != 1 ||
+		    p < 0 || p > 100 || serve_pct(d, n, p, f)) {
+			fprintf(f, "ERR usage: pct <file> <trace> <0-100>\n");
+			return;
+		}
+	} else {
+		fprintf(f, "ERR bad request\n");
+		return;
+	}
+out:
+	fputc('\n', f);
+}
+
+static void *serve_client(void *arg)
+{
+	struct client *c = arg;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *in, *out;
+
+	in = fdopen(c->fd, "r");
+	out = fdopen(dup(c->fd), "w");
+	if (!in || !out)
+		goto out;
+
+	while (getline(&line, &len, in) > 0) {
+		serve_request(c->db, line, out);
+		/* client went away mid-response */
+		if (fflush(out) || ferror(out))
+			break;
+	}
+out:
+	free(line);
+	if (out)
+		fclose(out);
+	if (in)
+		fclose(in);
+	else
+		close(c->fd);
+	free(c);
+
+	return NULL;
+}
+
+int serve(const struct delay_bank *db, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct client *c;
+	pthread_t thr;
+	int sock, fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return err_ret("Socket path too long\n");
+	strcpy(addr.sun_path, path);
+
+	/* writes to disconnected clients should fail, not kill the bank */
+	signal(SIGPIPE, SIG_IGN);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return perr_ret("Could not create socket");
+
+	unlink(path);
+	if (bind(sock, (void *)&addr, sizeof(addr)) || listen(sock, 16)) {
+		close(sock);
+		return perr_ret("Could not listen on socket");
+	}
+
+	msg("Serving %d files on %s\n", db->n, path);
+	fflush(stdout);
+
+	while ((fd = accept(sock, NULL, NULL)) >= 0 || errno == EINTR) {
+		if (fd < 0)
+			continue;
+
+		c = malloc(sizeof(*c));
+		c->db = db;
+		c->fd = fd;
+
+		if (pthread_create(&thr, NULL, serve_client, c)) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_detach(thr);
+	}
+
+	close(sock);
+
+	return perr_ret("Accepting connections failed");
+}
@@ -0,0 +1,659 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Results store.  Every run appends one block with a row per file and
+ * trace to a single file:
+ *
+ *   header (campaign, # of rows)
+ *   per column min and max (zone maps)
+ *   file names, NUL separated, padded to 8 bytes
+ *   file # column, u32, padded to 8 bytes
+ *   numeric columns, doubles, one after another
+ *
+ * Queries map the file, skip blocks whose campaign or zone maps rule the
+ * predicates out and evaluate the rest a column at a time into a row
+ * selection, so only the columns named in the query are touched.
+ */
+
+#include "mgr_interp.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ccan/tal/tal.h>
+#include <ccan/tal/str/str.h>
+
+#define STORE_MAX_PREDS	16
+
+static const char store_magic[8] = "MGRSTO\0\1";
+
+enum store_col {
+	SC_TRACE,
+	SC_N_SAMPLES,
+	SC_MIN,
+	SC_MAX,
+	SC_MEAN,
+	SC_STDEV,
+	SC_P50,
+	SC_P90,
+	SC_P99,
+	SC_P999,
+	SC_P9999,
+	SC_EVT_M,
+	SC_EVT_S,
+	SC_EVT_A,
+	SC_EVT_XCEED,
+	SC_CORR,
+
+	SC_N,
+};
+
+static const char *store_cols[] = {
+	"trace", "n", "min", "max", "mean", "stdev",
+	"p50", "p90", "p99", "p99.9", "p99.99",
+	"evt_m", "evt_s", "evt_a", "evt_xceed", "corr",
+};
+
+static const double store_pcts[] = { 50, 90, 99, 99.9, 99.99 };
+
+struct store_hdr {
+	char magic[8];
+	u64 len; /* of the whole block */
+	s64 time;
+	u32 n_rows;
+	u32 n_cols;
+	u32 names_len;
+	u32 n_traces; /* rows per file, 0 for 3 */
+	char campaign[64];
+};
+
+static u32 store_n_files(const struct store_hdr *hdr)
+{
+	return hdr->n_rows / (hdr->n_traces ?: 3);
+}
+
+#define ALIGN8(x)	(((x) + 7) & ~(size_t)7)
+
+static double store_pct(const struct trace *t, double p)
+{
+	u64 acc = 0;
+	u32 i;
+
+	for (i = 0; i < tal_count(t->distr); i++) {
+		acc += t->distr[i].cnt;
+		if (acc >= p / 100 * t->d->n_samples)
+			return t->distr[i].val;
+	}
+
+	return NAN;
+}
+
+static void store_row(const struct delay *d, u32 tr, double *row)
+{
+	const struct trace *t = &d->t[tr];
+	const bool evt = t->ed.ok;
+	u32 i;
+
+	row[SC_TRACE] = tr;
+	row[SC_N_SAMPLES] = d->n_samples;
+	row[SC_MIN] = d->n_samples ? t->min : NAN;
+	row[SC_MAX] = d->n_samples ? t->max : NAN;
+	row[SC_MEAN] = t->mean;
+	row[SC_STDEV] = t->stdev;
+	for (i = 0; i < 5; i++)
+		row[SC_P50 + i] = store_pct(t, store_pcts[i]);
+	row[SC_EVT_M] = evt ? t->ed.m : NAN;
+	row[SC_EVT_S] = evt ? t->ed.s : NAN;
+	row[SC_EVT_A] = evt ? t->ed.a : NAN;
+	row[SC_EVT_XCEED] = evt ? t->ed.xceed : NAN;
+	row[SC_CORR] = d->corr;
+}
+
+/* Add the bank as one block, the file is locked so runs can share it. */
+int store_append(const char *path, const char *campaign,
+		 const struct delay_bank *db)
+{
+	const u32 n_traces = db->n ? db->bank[0]->n_traces : 0;
+	const u32 n_rows = db->n * n_traces;
+	struct store_hdr hdr = {};
+	size_t names_len = 0, len, off;
+	double row[SC_N], *cols, *zmin, *zmax;
+	char *blk, *p;
+	u32 i, j, r, *file_id;
+	int fd, ret = 0;
+
+	if (!db->n)
+		return 0;
+
+	for (i = 0; i < (u32)db->n; i++)
+		names_len += strlen(db->bank[i]->fname) + 1;
+
+	len = sizeof(hdr) + 2 * SC_N * sizeof(double) + ALIGN8(names_len) +
+		ALIGN8(n_rows * sizeof(u32)) +
+		(size_t)SC_N * n_rows * sizeof(double);
+	blk = calloc(1, len);
+	if (!blk)
+		return err_ret("Could not allocate store block\n");
+
+	memcpy(hdr.magic, store_magic, sizeof(hdr.magic));
+	hdr.len = len;
+	hdr.time = time(NULL);
+	hdr.n_rows = n_rows;
+	hdr.n_cols = SC_N;
+	hdr.names_len = names_len;
+	hdr.n_traces = n_traces;
+	strncpy(hdr.campaign, campaign, sizeof(hdr.campaign) - 1);
+	memcpy(blk, &hdr, sizeof(hdr));
+
+	off = sizeof(hdr);
+	zmin = (double *)(blk + off);
+	zmax = zmin + SC_N;
+	off += 2 * SC_N * sizeof(double);
+
+	p = blk + off;
+	for (i = 0; i < (u32)db->n; i++)
+		p = stpcpy(p, db->bank[i]->fname) + 1;
+	off += ALIGN8(names_len);
+
+	file_id = (u32 *)(blk + off);
+	off += ALIGN8(n_rows * sizeof(u32));
+	cols = (double *)(blk + off);
+
+	for (j = 0; j < SC_N; j++) {
+		zmin[j] = INFINITY;
+		zmax[j] = -INFINITY;
+	}
+	for (r = 0; r < n_rows; r++) {
+		file_id[r] = r / n_traces;
+		store_row(db->bank[r / n_traces], r % n_traces, row);
+		for (j = 0; j < SC_N; j++) {
+			cols[(size_t)j * n_rows + r] = row[j];
+			/* NaNs don't match any predicate, leave them out */
+			if (row[j] < zmin[j])
+				zmin[j] = row[j];
+			if (row[j] > zmax[j])
+				zmax[j] = row[j];
+		}
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+	if (fd < 0) {
+		free(blk);
+		return perr_ret("Could not open results store");
+	}
+	flock(fd, LOCK_EX);
+	if (write(fd, blk, len) != (ssize_t)len)
+		ret = perr_ret("Writing results store failed");
+	close(fd);
+	free(blk);
+
+	msg("Stored %u rows in %s [campaign %s]\n", n_rows, path, hdr.campaign);
+
+	return ret;
+}
+
+enum pred_op { OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE };
+
+struct store_pred {
+	int col; /* -1 campaign, -2 file */
+	enum pred_op op;
+	double val;
+	const char *str;
+};
+
+struct store_query {
+	struct store_pred pred[STORE_MAX_PREDS];
+	u32 n_preds;
+
+	int sel[SC_N];
+	u32 n_sel;
+
+	int group; /* -1 campaign, -2 file, column or SC_N for none */
+};
+
+static int store_col_find(const char *name, size_t len)
+{
+	int i;
+
+	if (len == 8 && !strncmp(name, "campaign", len))
+		return -1;
+	if (len == 4 && !strncmp(name, "file", len))
+		return -2;
+	for (i = 0; i < SC_N; i++)
+		if (strlen(store_cols[i]) == len &&
+		    !strncmp(name, store_cols[i], len))
+			return i;
+
+	return SC_N;
+}
+
+static int store_parse_preds(struct store_query *q, char *where)
+{
+	static const char *ops[] = { "<", "<=", ">", ">=", "=", "!=" };
+	struct store_pred *pr;
+	char *tok, *op, *end;
+	int i;
+
+	for (tok = strtok(where, ","); tok; tok = strtok(NULL, ",")) {
+		if (q->n_preds == STORE_MAX_PREDS)
+			return err_ret("Too many predicates\n");
+		pr = &q->pred[q->n_preds++];
+
+		op = strpbrk(tok, "<>=!");
+		if (!op)
+			return err_ret("No operator in '%s'\n", tok);
+		pr->col = store_col_find(tok, op - tok);
+		if (pr->col == SC_N)
+			return err_ret("No column '%.*s'\n", (int)(op - tok), tok);
+
+		for (i = OP_NE; i >= 0; i--)
+			if (!strncmp(op, ops[i], strlen(ops[i])))
+				break;
+		if (i < 0)
+			return err_ret("Bad operator in '%s'\n", tok);
+		pr->op = i;
+		op += strlen(ops[i]);
+
+		if (pr->col < 0) {
+			if (pr->op != OP_EQ && pr->op != OP_NE)
+				return err_ret("Names only compare with = and !=\n");
+			pr->str = op;
+			continue;
+		}
+
+		pr->val = strtod(op, &end);
+		if (end == op || *end)
+			return err_ret("Bad value in '%s'\n", tok);
+	}
+
+	return 0;
+}
+
+static int store_parse_sel(struct store_query *q, char *sel)
+{
+	char *tok;
+
+	for (tok = strtok(sel, ","); tok; tok = strtok(NULL, ",")) {
+		q->sel[q->n_sel] = store_col_find(tok, strlen(tok));
+		if (q->sel[q->n_sel] < 0 || q->sel[q->n_sel] == SC_N)
+			return err_ret("No numeric column '%s'\n", tok);
+		if (++q->n_sel == SC_N)
+			break;
+	}
+
+	return 0;
+}
+
+static bool pred_holds(enum pred_op op, double v, double ref)
+{
+	switch (op) {
+	case OP_LT: return v < ref;
+	case OP_LE: return v <= ref;
+	case OP_GT: return v > ref;
+	case OP_GE: return v >= ref;
+	case OP_EQ: return v == ref;
+	case OP_NE: return v != ref;
+	}
+
+	return false;
+}
+
+/* Could any value in [lo, hi] satisfy the predicate? */
+static bool zone_may_hold(const struct store_pred *pr, double lo, double hi)
+{
+	switch (pr->op) {
+	case OP_LT: return lo < pr->val;
+	case OP_LE: return lo <= pr->val;
+	case OP_GT: return hi > pr->val;
+	case OP_GE: return hi >= pr->val;
+	case OP_EQ: return lo <= pr->val && pr->val <= hi;
+	case OP_NE: return !(lo == hi && lo == pr->val);
+	}
+
+	return true;
+}
+
+struct store_group {
+	char *key;
+	u64 n;
+	double min[SC_N];
+	double max[SC_N];
+	double sum[SC_N];
+	u64 cnt[SC_N]; /* non-NaN */
+};
+
+struct store_groups {
+	struct store_group **slots;
+	u32 n_slots;
+	u32 n;
+};
+
+static u32 str_hash(const char *s)
+{
+	u32 h = 2166136261U;
+
+	while (*s)
+		h = (h ^ (u8)*s++) * 16777619U;
+
+	return h;
+}
+
+static void group_insert(struct store_groups *gs, struct store_group *g)
+{
+	u32 i = str_hash(g->key) & (gs->n_slots - 1);
+
+	while (gs->slots[i])
+		i = (i + 1) & (gs->n_slots - 1);
+	gs->slots[i] = g;
+}
+
+static struct store_group *group_get(struct store_groups *gs, const char *key)
+{
+	struct store_group **old, *g;
+	u32 i, n_old;
+
+	i = str_hash(key) & (gs->n_slots - 1);
+	while (gs->slots[i] && strcmp(gs->slots[i]->key, key))
+		i = (i + 1) & (gs->n_slots - 1);
+	if (gs->slots[i])
+		return gs->slots[i];
+
+	if ((gs->n + 1) * 2 > gs->n_slots) {
+		old = gs->slots;
+		n_old = gs->n_slots;
+		gs->n_slots *= 2;
+		gs->slots = tal_arrz(gs, struct store_group *, gs->n_slots);
+		for (i = 0; i < n_old; i++)
+			if (old[i])
+				group_insert(gs, old[i]);
+		tal_free(old);
+	}
+
+	g = talz(gs, struct store_group);
+	g->key = tal_strdup(g, key);
+	for (i = 0; i < SC_N; i++) {
+		g->min[i] = INFINITY;
+		g->max[i] = -INFINITY;
+	}
+	group_insert(gs, g);
+	gs->n++;
+
+	return g;
+}
+
+static void group_add(struct store_group *g, const double *cols, u32 n_rows,
+		      u32 r)
+{
+	double v;
+	u32 j;
+
+	g->n++;
+	for (j = 0; j < SC_N; j++) {
+		v = cols[(size_t)j * n_rows + r];
+		if (isnan(v))
+			continue;
+		g->cnt[j]++;
+		g->sum[j] += v;
+		if (v < g->min[j])
+			g->min[j] = v;
+		if (v > g->max[j])
+			g->max[j] = v;
+	}
+}
+
+static int group_cmp(const void *a1, const void *a2)
+{
+	const struct store_group *a = *(struct store_group **)a1;
+	const struct store_group *b = *(struct store_group **)a2;
+
+	return strcmp(a->key, b->key);
+}
+
+static void store_print_groups(const struct store_query *q,
+			       struct store_groups *gs)
+{
+	struct store_group **all, *g;
+	u32 i, j, n = 0;
+	int c;
+
+	printf("# group n");
+	for (j = 0; j < q->n_sel; j++) {
+		c = q->sel[j];
+		printf(" %s_min %s_mean %s_max",
+		       store_cols[c], store_cols[c], store_cols[c]);
+	}
+	putchar('\n');
+
+	all = tal_arr(gs, struct store_group *, gs->n);
+	for (i = 0; i < gs->n_slots; i++)
+		if (gs->slots[i])
+			all[n++] = gs->slots[i];
+	qsort(all, n, sizeof(*all), group_cmp);
+
+	for (i = 0; i < n; i++) {
+		g = all[i];
+		printf("%s %" PRIu64, g->key, g->n);
+		for (j = 0; j < q->n_sel; j++) {
+			c = q->sel[j];
+			if (g->cnt[c])
+				printf(" %lg %lg %lg", g->min[c],
+				       g->sum[c] / g->cnt[c], g->max[c]);
+			else
+				printf(" nan nan nan");
+		}
+		putchar('\n');
+	}
+}
+
+static void store_print_row(const struct store_hdr *hdr, const char *fname,
+			    const double *cols, u32 r)
+{
+	u32 j;
+
+	printf("%s %s", hdr->campaign, fname);
+	for (j = 0; j < SC_N; j++)
+		printf(" %lg", cols[(size_t)j * hdr->n_rows + r]);
+	putchar('\n');
+}
+
+/* Campaign and zone map checks, true if the block can't have a match */
+static bool store_skip_block(const struct store_query *q,
+			     const struct store_hdr *hdr,
+			     const double *zmin, const double *zmax)
+{
+	const struct store_pred *pr;
+	u32 i;
+
+	for (i = 0; i < q->n_preds; i++) {
+		pr = &q->pred[i];
+		if (pr->col == -1 &&
+		    !strcmp(hdr->campaign, pr->str) != (pr->op == OP_EQ))
+			return true;
+		if (pr->col >= 0 && !zone_may_hold(pr, zmin[pr->col],
+						   zmax[pr->col]))
+			return true;
+	}
+
+	return false;
+}
+
+static void store_match_block(const struct store_query *q,
+			      const struct store_hdr *hdr, const char **names,
+			      const u32 *file_id, const double *cols,
+			      u8 *match)
+{
+	const u32 n_rows = hdr->n_rows, n_files = store_n_files(hdr);
+	const struct store_pred *pr;
+	const double *c;
+	u8 *file_ok;
+	u32 i, r;
+
+	memset(match, 1, n_rows);
+
+	for (i = 0; i < q->n_preds; i++) {
+		pr = &q->pred[i];
+		if (pr->col == -2) {
+			file_ok = tal_arr(NULL, u8, n_files);
+			for (r = 0; r < n_files; r++)
+				file_ok[r] = !strcmp(names[r], pr->str) ==
+					(pr->op == OP_EQ);
+			for (r = 0; r < n_rows; r++)
+				match[r] &= file_ok[file_id[r]];
+			tal_free(file_ok);
+		} else if (pr->col >= 0) {
+			c = cols + (size_t)pr->col * n_rows;
+			for (r = 0; r < n_rows; r++)
+				match[r] &= pred_holds(pr->op, c[r], pr->val);
+		}
+	}
+}
+
+int store_query(const char *path, const char *where, const char *select,
+		const char *group_by)
+{
+	struct store_query q = { .group = SC_N };
+	const struct store_hdr *hdr;
+	const double *zmin, *zmax, *cols;
+	const u32 *file_id;
+	const char **names, *p, *key;
+	struct store_groups *gs;
+	u32 i, r, n_blocks = 0, n_skipped = 0;
+	u64 n_match = 0;
+	char *tmp, buf[16];
+	size_t off, size;
+	struct stat st;
+	u8 *match;
+	void *base;
+	int fd, ret = 0;
+
+	/* predicates point into tmp */
+	tmp = tal_strdup(NULL, where ?: "");
+	if (store_parse_preds(&q, tmp) ||
+	    (select && store_parse_sel(&q, tal_strdup(tmp, select)))) {
+		tal_free(tmp);
+		return 1;
+	}
+	if (group_by) {
+		q.group = store_col_find(group_by, strlen(group_by));
+		if (q.group == SC_N && strcmp(group_by, "all")) {
+			tal_free(tmp);
+			return err_ret("Can't group by '%s'\n", group_by);
+		}
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		tal_free(tmp);
+		if (fd >= 0)
+			close(fd);
+		return perr_ret("Could not open results store");
+	}
+	size = st.st_size;
+	base = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	close(fd);
+	if (base == MAP_FAILED) {
+		tal_free(tmp);
+		return perr_ret("Could not map results store");
+	}
+
+	gs = talz(tmp, struct store_groups);
+	gs->n_slots = 64;
+	gs->slots = tal_arrz(gs, struct store_group *, gs->n_slots);
+	match = tal_arr(gs, u8, 0);
+	names = tal_arr(gs, const char *, 0);
+
+	if (!q.n_sel) {
+		printf("# campaign file");
+		for (i = 0; i < SC_N; i++)
+			printf(" %s", store_cols[i]);
+		putchar('\n');
+	}
+
+	for (off = 0; off + sizeof(*hdr) <= size; off += hdr->len) {
+		hdr = base + off;
+		if (memcmp(hdr->magic, store_magic, sizeof(hdr->magic)) ||
+		    hdr->n_cols != SC_N || hdr->len > size - off ||
+		    hdr->len < sizeof(*hdr)) {
+			ret = err_ret("Results store corrupted at %zu\n", off);
+			break;
+		}
+		n_blocks++;
+
+		zmin = base + off + sizeof(*hdr);
+		zmax = zmin + SC_N;
+		if (store_skip_block(&q, hdr, zmin, zmax)) {
+			n_skipped++;
+			continue;
+		}
+
+		p = (const char *)(zmax + SC_N);
+		tal_resize(&names, store_n_files(hdr));
+		for (i = 0; i < store_n_files(hdr); i++) {
+			names[i] = p;
+			p += strlen(p) + 1;
+		}
+		file_id = (const u32 *)((const char *)(zmax + SC_N) +
+					ALIGN8(hdr->names_len));
+		cols = (const double *)((const char *)file_id +
+					ALIGN8(hdr->n_rows * sizeof(u32)));
+
+		tal_resize(&match, hdr->n_rows);
+		store_match_block(&q, hdr, names, file_id, cols, match);
+
+		for (r = 0; r < hdr->n_rows; r++) {
+			if (!match[r])
+				continue;
+			n_match++;
+
+			if (!q.n_sel) {
+				store_print_row(hdr, names[file_id[r]],
+						cols, r);
+				continue;
+			}
+
+			if (q.group == -1) {
+				key = hdr->campaign;
+			} else if (q.group == -2) {
+				key = names[file_id[r]];
+			} else if (q.group < SC_N) {
+				snprintf(buf, sizeof(buf), "%lg",
+					 cols[(size_t)q.group * hdr->n_rows + r]);
+				key = buf;
+			} else {
+				key = "all";
+			}
+			group_add(group_get(gs, key), cols, hdr->n_rows, r);
+		}
+	}
+
+	if (q.n_sel)
+		store_print_groups(&q, gs);
+	printf("# %" PRIu64 " rows matched, %u of %u blocks skipped\n",
+	       n_match, n_skipped, n_blocks);
+
+	tal_free(tmp);
+	if (size)
+		munmap(base, size);
+
+	return ret;
+}
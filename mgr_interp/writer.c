@@ -0,0 +1,331 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ * Copyright (C) 2014 Jakub Kicinski <kubakici@wp.pl>
+ */
+
+/* Output writer.  Dumps go through a large buffer with integer and double
+ * conversions done by hand, which is a lot cheaper than fprintf per value.
+ * Text matches what printf's %u, %d, %lf and %le would produce, doubles
+ * too close to a rounding boundary to be sure are left to snprintf.  The
+ * same calls write raw little-endian values for --format bin and npy, row
+ * separators and newlines are dropped then.
+ */
+
+#include "mgr_interp.h"
+
+#include <endian.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <ccan/tal/tal.h>
+
+#define WBUF_SIZE	(1 << 20)
+#define WBUF_SLACK	64 /* longest single value */
+
+#define NPY_HDR_LEN	128
+
+const char *format_names[] = {
+	"text", "bin", "npy",
+};
+
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+static const double pow10_tbl[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static void wb_flush(struct wbuf *w)
+{
+	if (w->p > w->buf && fwrite(w->buf, w->p - w->buf, 1, w->f) != 1)
+		w->err = true;
+	w->p = w->buf;
+}
+
+static inline char *wb_room(struct wbuf *w)
+{
+	if (unlikely(w->p + WBUF_SLACK > w->buf + WBUF_SIZE))
+		wb_flush(w);
+
+	return w->p;
+}
+
+int wb_open(struct wbuf *w, FILE *f, enum out_format fmt)
+{
+	memset(w, 0, sizeof(*w));
+	w->f = f;
+	w->fmt = fmt;
+	w->buf = malloc(WBUF_SIZE);
+	w->p = w->buf;
+
+	return w->buf ? 0 : err_ret("Could not allocate output buffer\n");
+}
+
+static void npy_header(struct wbuf *w)
+{
+	char *p = wb_room(w);
+	int n;
+
+	memcpy(p, "\x93NUMPY\x01\x00", 8);
+	p[8] = NPY_HDR_LEN - 10;
+	p[9] = 0;
+	n = snprintf(p + 10, NPY_HDR_LEN - 10,
+		     "{'descr': '%s', 'fortran_order': False, 'shape': (%u, %u), }",
+		     w->dtype, w->n_rows, w->n_cols);
+	memset(p + 10 + n, ' ', NPY_HDR_LEN - 10 - n);
+	p[NPY_HDR_LEN - 1] = '\n';
+
+	w->p += NPY_HDR_LEN;
+}
+
+/* Start a matrix of @n_cols values of @dtype ("<u4", "<f8") per row. */
+void wb_begin(struct wbuf *w, const char *dtype, u32 n_cols)
+{
+	w->dtype = dtype;
+	w->n_cols = n_cols;
+	w->n_rows = 0;
+
+	if (w->fmt == FMT_NPY)
+		npy_header(w);
+}
+
+/* Flush and, for .npy, go back to put the final shape in the header. */
+int wb_close(struct wbuf *w)
+{
+	wb_flush(w);
+
+	if (w->fmt == FMT_NPY && w->dtype) {
+		if (fseek(w->f, 0, SEEK_SET)) {
+			w->err = true;
+		} else {
+			npy_header(w);
+			wb_flush(w);
+			fseek(w->f, 0, SEEK_END);
+		}
+	}
+
+	free(w->buf);
+	w->buf = NULL;
+
+	return w->err ? err_ret("Writing output failed\n") : 0;
+}
+
+void wb_char(struct wbuf *w, char c)
+{
+	if (w->fmt != FMT_TEXT)
+		return;
+
+	*wb_room(w) = c;
+	w->p++;
+}
+
+void wb_eol(struct wbuf *w)
+{
+	wb_char(w, '\n');
+	w->n_rows++;
+}
+
+static char *fmt_u64(char *p, u64 v)
+{
+	char tmp[20], *q = tmp + sizeof(tmp);
+	u32 d;
+
+	while (v >= 100) {
+		d = v % 100 * 2;
+		v /= 100;
+		*--q = digit_pairs[d + 1];
+		*--q = digit_pairs[d];
+	}
+	if (v >= 10) {
+		*--q = digit_pairs[v * 2 + 1];
+		*--q = digit_pairs[v * 2];
+	} else {
+		*--q = '0' + v;
+	}
+
+	memcpy(p, q, tmp + sizeof(tmp) - q);
+
+	return p + (tmp + sizeof(tmp) - q);
+}
+
+/* @n digits of @v, zero padded */
+static char *fmt_fixed(char *p, u32 v, int n)
+{
+	int i;
+
+	for (i = n - 1; i >= 0; i--) {
+		p[i] = '0' + v % 10;
+		v /= 10;
+	}
+
+	return p + n;
+}
+
+void wb_u32(struct wbuf *w, u32 v)
+{
+	u32 le;
+
+	if (w->fmt != FMT_TEXT) {
+		le = htole32(v);
+		memcpy(wb_room(w), &le, sizeof(le));
+		w->p += sizeof(le);
+		return;
+	}
+
+	w->p = fmt_u64(wb_room(w), v);
+}
+
+/* Values printed with %d, stays in u32 for binary formats. */
+void wb_s32(struct wbuf *w, s32 v)
+{
+	char *p;
+
+	if (w->fmt != FMT_TEXT || v >= 0) {
+		wb_u32(w, v);
+		return;
+	}
+
+	p = wb_room(w);
+	*p++ = '-';
+	w->p = fmt_u64(p, -(s64)v);
+}
+
+/* Round @x to an integer unless it's too close to a .5 to be sure. */
+static bool round_sure(double x, u64 *r)
+{
+	double f = nearbyint(x);
+
+	if (fabs(fabs(x - f) - 0.5) <= x * 4e-16 + 1e-9)
+		return false;
+
+	*r = f;
+
+	return true;
+}
+
+/* %lf */
+static char *fmt_f(char *p, double v)
+{
+	const double a = fabs(v);
+	u64 r;
+
+	if (!(a < 1e9) || !round_sure(a * 1e6, &r))
+		return NULL;
+
+	if (signbit(v))
+		*p++ = '-';
+	p = fmt_u64(p, r / 1000000);
+	*p++ = '.';
+
+	return fmt_fixed(p, r % 1000000, 6);
+}
+
+/* %le */
+static char *fmt_e(char *p, double v)
+{
+	const double a = fabs(v);
+	int e, retry;
+	u64 r = 0;
+
+	if (!isfinite(v))
+		return NULL;
+
+	e = a ? (int)floor(log10(a)) : 0;
+	for (retry = 0; a && retry < 2; retry++) {
+		if (e - 6 > 22 || 6 - e > 22)
+			return NULL;
+		if (!round_sure(e <= 6 ? a * pow10_tbl[6 - e] :
+				a / pow10_tbl[e - 6], &r))
+			return NULL;
+
+		if (r >= 10000000)
+			e++;
+		else if (r < 1000000)
+			e--;
+		else
+			break;
+	}
+	if (a && retry == 2)
+		return NULL;
+
+	if (signbit(v))
+		*p++ = '-';
+	*p++ = '0' + r / 1000000;
+	*p++ = '.';
+	p = fmt_fixed(p, r % 1000000, 6);
+	*p++ = 'e';
+	*p++ = e < 0 ? '-' : '+';
+	if (abs(e) < 10)
+		*p++ = '0';
+
+	return fmt_u64(p, abs(e));
+}
+
+/* @conv is 'f' or 'e' as in printf */
+void wb_dbl(struct wbuf *w, double v, char conv)
+{
+	char *p, *end;
+	u64 le;
+
+	if (w->fmt != FMT_TEXT) {
+		memcpy(&le, &v, sizeof(le));
+		le = htole64(le);
+		memcpy(wb_room(w), &le, sizeof(le));
+		w->p += sizeof(le);
+		return;
+	}
+
+	p = wb_room(w);
+	end = conv == 'e' ? fmt_e(p, v) : fmt_f(p, v);
+	if (end)
+		w->p = end;
+	else
+		wb_printf(w, conv == 'e' ? "%le" : "%lf", v);
+}
+
+/* Anything else, text only. */
+void wb_printf(struct wbuf *w, const char *fmt, ...)
+{
+	va_list ap;
+	size_t left;
+	char *p;
+	int n;
+
+	if (w->fmt != FMT_TEXT)
+		return;
+
+	p = wb_room(w);
+	left = w->buf + WBUF_SIZE - p;
+
+	va_start(ap, fmt);
+	n = vsnprintf(p, left, fmt, ap);
+	va_end(ap);
+
+	if ((size_t)n < left) {
+		w->p += n;
+		return;
+	}
+
+	/* didn't fit after all, give up on buffering this one */
+	wb_flush(w);
+	va_start(ap, fmt);
+	vfprintf(w->f, fmt, ap);
+	va_end(ap);
+}
@@ -25,8 +25,10 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -60,6 +62,9 @@ bool g_hm;
 int g_n_skip;
 bool g_msg = true;
 
+pcap_t *g_pcap;
+bool g_stop_at_end; /* only printing a range, rest of the file can go */
+
 static struct opt_table opts[] = {
 	OPT_WITH_ARG("-i|--interface <ifname>", opt_set_charp, NULL,
 		     &g_ifc_name, "live capture on interface <ifname>"),
@@ -97,6 +102,33 @@ struct result_frame {
 	uint64_t ts;
 } __attribute__ ((packed));
 
+/* Frame offset index written by mgr_interp --index, see mgr_interp.h */
+struct frame_index_hdr {
+	char magic[8];
+	u32 stride;
+	u32 n_ent;
+	u64 size;
+	s64 mtime;
+	s32 ifg;
+	u32 skip_notif;
+	u32 n_duts;
+	u32 pad;
+};
+
+struct frame_index_ent {
+	u64 offset;
+	u64 elapsed;
+	u64 p_tx_ts;
+	u64 p_rx_ts[8];
+	u32 pair;
+	u32 res;
+	u32 last_tx;
+	u32 skip_after_notif;
+	u8 is_first;
+	u8 seen_tx;
+	u8 pad[6];
+};
+
 struct list_head g_pkt_queue[2] = {
 	LIST_HEAD_INIT(g_pkt_queue[0]),
 	LIST_HEAD_INIT(g_pkt_queue[1])
@@ -142,25 +174,73 @@ static inline void dist_record(unsigned long long tbl[],
 	tbl[val]++;
 }
 
-#define MIN 2500
-#define M_S (1 << 12)
+/* Heatmap cells are HM_AGGR clocks wide and live in HM_TILE x HM_TILE tiles
+ * allocated on first use, so there is no fixed window of delays to fit in.
+ */
+#define HM_AGGR		2
+#define HM_TILE_SHIFT	6
+#define HM_TILE		(1 << HM_TILE_SHIFT)
+#define HM_TILE_MASK	(HM_TILE - 1)
+
+struct hm_tile {
+	int tx, ty;
+	unsigned cnt[HM_TILE][HM_TILE];
+};
+
+int hm_max_1 = -1, hm_max_2 = -1, hm_min_1 = INT_MAX, hm_min_2 = INT_MAX;
+struct hm_tile **hm_tiles;
+unsigned hm_n_slots, hm_n_tiles; /* open addressing, n_slots power of 2 */
+
+static struct hm_tile **hm_slot(int tx, int ty)
+{
+	unsigned i = (tx * 0x9e3779b1U ^ ty * 0x85ebca6bU) & (hm_n_slots - 1);
+
+	while (hm_tiles[i] && (hm_tiles[i]->tx != tx || hm_tiles[i]->ty != ty))
+		i = (i + 1) & (hm_n_slots - 1);
+
+	return &hm_tiles[i];
+}
+
+static struct hm_tile *hm_tile_get(int tx, int ty)
+{
+	struct hm_tile **old = hm_tiles, **slot;
+	unsigned i, n_old = hm_n_slots;
+
+	if (!hm_tiles || (hm_n_tiles + 1) * 2 > hm_n_slots) {
+		hm_n_slots = hm_n_slots ? hm_n_slots * 2 : 64;
+		hm_tiles = calloc(hm_n_slots, sizeof(*hm_tiles));
+		for (i = 0; i < n_old; i++)
+			if (old[i])
+				*hm_slot(old[i]->tx, old[i]->ty) = old[i];
+		free(old);
+	}
+
+	slot = hm_slot(tx, ty);
+	if (!*slot) {
+		*slot = calloc(1, sizeof(**slot));
+		(*slot)->tx = tx;
+		(*slot)->ty = ty;
+		hm_n_tiles++;
+	}
 
-int hm_max_1, hm_max_2, hm_min_1 = M_S, hm_min_2 = M_S;
-unsigned arr[M_S][M_S];
+	return *slot;
+}
 
 static inline void hm_record(int r1, int r2)
 {
-	r1 -= MIN;
-	r2 -= MIN;
-	r1 /= 2;
-	r2 /= 2;
+	static struct hm_tile *last;
 
 	if (r1 < 0 || r2 < 0) {
 		msg("HM min underflow by %d %d\n", r1, r2);
 		return;
 	}
+	r1 /= HM_AGGR;
+	r2 /= HM_AGGR;
 
-	arr[r1][r2]++;
+	if (!last || last->tx != r1 >> HM_TILE_SHIFT ||
+	    last->ty != r2 >> HM_TILE_SHIFT)
+		last = hm_tile_get(r1 >> HM_TILE_SHIFT, r2 >> HM_TILE_SHIFT);
+	last->cnt[r1 & HM_TILE_MASK][r2 & HM_TILE_MASK]++;
 
 	if (hm_max_1 < r1)
 		hm_max_1 = r1;
@@ -174,11 +254,17 @@ static inline void hm_record(int r1, int r2)
 
 void hm_dump(void)
 {
+	struct hm_tile *tile = NULL;
 	int i, j;
 
 	for (i = hm_min_1; i <= hm_max_1; i++) {
-		for (j = hm_min_2; j <= hm_max_2; j++)
-			printf("%d ", arr[i][j]);
+		for (j = hm_min_2; j <= hm_max_2; j++) {
+			if (j == hm_min_2 || !(j & HM_TILE_MASK))
+				tile = *hm_slot(i >> HM_TILE_SHIFT,
+						j >> HM_TILE_SHIFT);
+			printf("%d ", tile ? tile->cnt[i & HM_TILE_MASK]
+						 [j & HM_TILE_MASK] : 0);
+		}
 		putchar('\n');
 	}
 }
@@ -336,6 +422,10 @@ void packet_cb(u_char *args, const struct pcap_pkthdr *header,
 		    is_time_backward(dut2->r[i].rx_ts, &last_rx_ts2))
 			msg("Time runs backward [pair %llu]\n", pair_no);
 		*/
+		if (g_stop_at_end && pair_no >= g_pr_end) {
+			pcap_breakloop(g_pcap);
+			goto cb_out;
+		}
 		result_process_pair(&dut1->r[i], &dut2->r[i],
 				    tx_ts, !!skip_frames);
 
@@ -368,6 +458,43 @@ void dist_dump(unsigned long long *t1, unsigned long long *t2,
 	}
 }
 
+/* Start reading at the last indexed frame pair before -b, pair_no is the
+ * result # so it carries over from the index as is.
+ */
+static void index_seek(pcap_t *pcap)
+{
+	struct frame_index_hdr hdr;
+	struct frame_index_ent e, best;
+	struct stat st;
+	char path[4096];
+	bool found = false;
+	FILE *f;
+	u32 i;
+
+	snprintf(path, sizeof(path), "%s.idx", g_file_name);
+	if (stat(g_file_name, &st) || !(f = fopen(path, "r")))
+		return;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, "MGRIDX\0\2", sizeof(hdr.magic)) ||
+	    hdr.n_duts != 2 ||
+	    hdr.size != (u64)st.st_size || hdr.mtime != (s64)st.st_mtime) {
+		fclose(f);
+		return;
+	}
+
+	for (i = 0; i < hdr.n_ent && fread(&e, sizeof(e), 1, f) == 1; i++) {
+		if (e.res > g_pr_start)
+			break;
+		best = e;
+		found = true;
+	}
+	fclose(f);
+
+	if (found && !fseeko(pcap_file(pcap), best.offset, SEEK_SET))
+		pair_no = best.res;
+}
+
 int main(int argc, char **argv)
 {
 	char errbuf[PCAP_ERRBUF_SIZE];
@@ -393,6 +520,12 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Couldn't open packet source: %s\n", errbuf);
 		return 1;
 	}
+	g_pcap = pcap_src;
+
+	g_stop_at_end = g_file_name && g_pr_end && !g_dump && !g_hm &&
+		!g_search_val;
+	if (g_stop_at_end && g_pr_start)
+		index_seek(pcap_src);
 
 	pcap_loop(pcap_src, PCAP_CNT_INF, packet_cb, NULL);
 